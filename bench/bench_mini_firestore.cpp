@@ -0,0 +1,353 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include "mini_firestore.h"
+#include "mini_firestore_emulator.h"
+#include "bench_utils.h"
+
+using namespace MiniFireStore;
+
+// ----------------------------------
+struct Options {
+  std::vector< std::string > ops = { "read", "write", "add", "inc", "query", "listAll", "delete" };
+  std::vector< int > concurrency = { 1, 16 };
+  std::vector< int > doc_sizes = { 256, 4096 };
+  int         requests = 500;
+  int         docs = 100;               // Docs in the collection used by read/write/inc/query
+  int         list_docs = 50;           // Docs in the collection used by listAll
+  int         delete_docs = 10;         // Docs in each collection deleted
+  int         latency_ms = 0;
+  int         latency_jitter_ms = 0;
+  int         server_rate = 0;          // Max requests/sec answered by the emulator while measuring. 0 for no limit
+  double      rate_limit = 0.0;         // Initial rate of the client side limiter. 0 to disable it
+  std::string json_path;
+  std::string trace_path;
+};
+
+struct RunResult {
+  std::string op;
+  int         concurrency = 0;
+  int         doc_size = 0;
+  int         requests = 0;
+  int         errors = 0;
+  double      seconds = 0.0;
+  double      cpu_seconds = 0.0;
+  uint64_t    allocs = 0;
+  std::vector< double > latencies_us;
+
+  double percentile(double p) const {
+    if (latencies_us.empty())
+      return 0.0;
+    size_t idx = std::min(latencies_us.size() - 1, (size_t)(p * latencies_us.size()));
+    return latencies_us[idx];
+  }
+};
+
+static void to_json(json& j, const RunResult& r) {
+  double n = r.requests ? (double)r.requests : 1.0;
+  j = {
+    {"op", r.op},
+    {"concurrency", r.concurrency},
+    {"doc_size", r.doc_size},
+    {"requests", r.requests},
+    {"errors", r.errors},
+    {"seconds", r.seconds},
+    {"requests_per_sec", r.seconds > 0.0 ? r.requests / r.seconds : 0.0},
+    {"latency_us", {
+      {"p50", r.percentile(0.50)},
+      {"p99", r.percentile(0.99)},
+      {"p999", r.percentile(0.999)},
+      {"max", r.latencies_us.empty() ? 0.0 : r.latencies_us.back()},
+    }},
+    {"allocs_per_request", r.allocs / n},
+    {"cpu_us_per_request", r.cpu_seconds * 1e6 / n},
+  };
+}
+
+// ----------------------------------
+class Bench {
+public:
+  using Issue = std::function<void(int i, Callback cb)>;
+
+  Bench(Firestore& new_db, Emulator& new_emulator, const Options& new_opts) : db(new_db), emulator(new_emulator), opts(new_opts) {}
+
+  // Keeps 'concurrency' requests on the fly until 'total' requests complete
+  RunResult run(const std::string& op, int concurrency, int doc_size, int total, Issue issue) {
+    RunResult res;
+    res.op = op;
+    res.concurrency = concurrency;
+    res.doc_size = doc_size;
+    res.requests = total;
+    res.latencies_us.reserve(total);
+
+    int issued = 0;
+    int completed = 0;
+    std::function<void()> issueNext = [&]() {
+      int i = issued++;
+      auto t0 = std::chrono::steady_clock::now();
+      issue(i, [&, t0](Result& r) {
+        auto t1 = std::chrono::steady_clock::now();
+        res.latencies_us.push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+        if (r.err)
+          ++res.errors;
+        ++completed;
+        if (issued < total)
+          issueNext();
+      });
+    };
+
+    uint64_t allocs0 = threadAllocs();
+    double cpu0 = threadCpuSeconds();
+    auto wall0 = std::chrono::steady_clock::now();
+
+    while (issued < concurrency && issued < total)
+      issueNext();
+    waitUntil([&]() { return completed == total; });
+
+    res.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall0).count();
+    res.cpu_seconds = threadCpuSeconds() - cpu0;
+    res.allocs = threadAllocs() - allocs0;
+    std::sort(res.latencies_us.begin(), res.latencies_us.end());
+    return res;
+  }
+
+  void waitUntil(std::function<bool()> done) {
+    while (!done()) {
+      if (!db.update())
+        db.wait(10);
+    }
+  }
+
+  // Runs the requests without measuring anything
+  void prepare(int total, Issue issue) {
+    int completed = 0;
+    for (int i = 0; i < total; ++i)
+      issue(i, [&](Result& r) { ++completed; });
+    waitUntil([&]() { return completed == total; });
+  }
+
+  static json makeDoc(int index, int doc_size) {
+    return {
+      {"index", index},
+      {"name", "Document " + std::to_string(index)},
+      {"counter", 0},
+      {"enabled", (index & 1) == 0},
+      {"tags", { "bench", "mini_firestore" }},
+      {"payload", std::string(doc_size, 'x')},
+    };
+  }
+
+  std::vector< RunResult > runAll() {
+    std::vector< RunResult > results;
+    int run_id = 0;
+    for (int doc_size : opts.doc_sizes) {
+      for (int concurrency : opts.concurrency) {
+        std::string root = "bench/run" + std::to_string(run_id++);
+        Ref coll = db.ref(root + "/docs");
+        Ref list_coll = db.ref(root + "/list");
+        Ref add_coll = db.ref(root + "/added");
+        json doc = makeDoc(0, doc_size);
+
+        // Populate the collections used by the read operations
+        prepare(opts.docs, [&](int i, Callback cb) { coll.child("doc" + std::to_string(i)).write(makeDoc(i, doc_size), cb); });
+        prepare(opts.list_docs, [&](int i, Callback cb) { list_coll.child("doc" + std::to_string(i)).write(makeDoc(i, doc_size), cb); });
+
+        for (auto& op : opts.ops) {
+          Issue issue;
+          int total = opts.requests;
+          if (op == "read") {
+            issue = [&](int i, Callback cb) { coll.child("doc" + std::to_string(i % opts.docs)).read(cb); };
+          }
+          else if (op == "write") {
+            issue = [&](int i, Callback cb) { coll.child("doc" + std::to_string(i % opts.docs)).write(doc, cb); };
+          }
+          else if (op == "add") {
+            issue = [&](int i, Callback cb) { add_coll.add(doc, cb); };
+          }
+          else if (op == "inc") {
+            issue = [&](int i, Callback cb) { coll.child("doc" + std::to_string(i % opts.docs)).inc("counter", 1, cb); };
+          }
+          else if (op == "query") {
+            Query q;
+            q.conditions.emplace_back("index", Condition::GreaterThanOrEqual, opts.docs / 2);
+            q.order_by.emplace_back("index", Query::ASCENDING);
+            q.limit = 10;
+            issue = [&, q](int i, Callback cb) { coll.query(q, cb); };
+          }
+          else if (op == "listAll") {
+            issue = [&](int i, Callback cb) { list_coll.listAll(cb); };
+          }
+          else if (op == "delete") {
+            // Each request deletes a full collection, which is populated before measuring
+            total = std::max(1, opts.requests / opts.delete_docs);
+            auto delColl = [&](int i) { return db.ref(root + "/del" + std::to_string(i)); };
+            prepare(total * opts.delete_docs, [&](int i, Callback cb) {
+              delColl(i / opts.delete_docs).child("doc" + std::to_string(i % opts.delete_docs)).write(doc, cb);
+            });
+            issue = [&, delColl](int i, Callback cb) { delColl(i).del(cb); };
+          }
+          else {
+            fprintf(stderr, "Unknown op %s\n", op.c_str());
+            continue;
+          }
+
+          // Only the measured requests are throttled, and each run starts with a fresh limiter
+          RateLimits limits;
+          limits.enabled = opts.rate_limit > 0.0;
+          limits.initial_rate = opts.rate_limit;
+          db.setRateLimits(limits);
+          Emulator::Config config = emulator.config();
+          Emulator::Config throttled = config;
+          throttled.max_requests_per_sec = opts.server_rate;
+          emulator.setConfig(throttled);
+          RunResult r = run(op, concurrency, doc_size, total, issue);
+          emulator.setConfig(config);
+          fprintf(stderr, "%-8s size:%6d conc:%4d  %8.1f req/s  p50:%8.0fus  p99:%8.0fus  p999:%8.0fus  allocs/req:%7.1f  cpu/req:%7.1fus  errors:%d\n",
+            r.op.c_str(), r.doc_size, r.concurrency, r.requests / r.seconds,
+            r.percentile(0.5), r.percentile(0.99), r.percentile(0.999),
+            (double)r.allocs / r.requests, r.cpu_seconds * 1e6 / r.requests, r.errors);
+          results.push_back(std::move(r));
+        }
+      }
+    }
+    return results;
+  }
+
+private:
+  Firestore& db;
+  Emulator&  emulator;
+  Options    opts;
+};
+
+// ----------------------------------
+static std::vector< std::string > splitList(const char* s) {
+  std::vector< std::string > items;
+  std::string item;
+  for (; *s; ++s) {
+    if (*s == ',') {
+      items.push_back(item);
+      item.clear();
+    }
+    else {
+      item.push_back(*s);
+    }
+  }
+  if (!item.empty())
+    items.push_back(item);
+  return items;
+}
+
+static std::vector< int > splitInts(const char* s) {
+  std::vector< int > values;
+  for (auto& item : splitList(s))
+    values.push_back(atoi(item.c_str()));
+  return values;
+}
+
+static void usage() {
+  printf("bench_app [options]\n");
+  printf("  --ops=read,write,add,inc,query,listAll,delete\n");
+  printf("  --concurrency=1,16        Requests on the fly\n");
+  printf("  --doc-sizes=256,4096      Bytes of payload in each doc\n");
+  printf("  --requests=500            Requests per op\n");
+  printf("  --latency-ms=0            Latency added by the emulator\n");
+  printf("  --jitter-ms=0             Random extra latency added by the emulator\n");
+  printf("  --server-rate=0           Requests/sec answered by the emulator, the rest get RESOURCE_EXHAUSTED\n");
+  printf("  --rate-limit=0            Enable the client rate limiter starting at this rate\n");
+  printf("  --json=path               Save the results as json. Use - for stdout\n");
+  printf("  --trace=path              Save the requests in the chrome trace event format\n");
+}
+
+int main(int argc, char** argv) {
+  Options opts;
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    const char* eq = strchr(arg, '=');
+    std::string key = eq ? std::string(arg, eq - arg) : std::string(arg);
+    const char* value = eq ? eq + 1 : "";
+    if (key == "--ops") opts.ops = splitList(value);
+    else if (key == "--concurrency") opts.concurrency = splitInts(value);
+    else if (key == "--doc-sizes") opts.doc_sizes = splitInts(value);
+    else if (key == "--requests") opts.requests = atoi(value);
+    else if (key == "--latency-ms") opts.latency_ms = atoi(value);
+    else if (key == "--jitter-ms") opts.latency_jitter_ms = atoi(value);
+    else if (key == "--server-rate") opts.server_rate = atoi(value);
+    else if (key == "--rate-limit") opts.rate_limit = atof(value);
+    else if (key == "--json") opts.json_path = value;
+    else if (key == "--trace") opts.trace_path = value;
+    else {
+      usage();
+      return key == "--help" ? 0 : -1;
+    }
+  }
+
+  globalInit();
+
+  Emulator emulator;
+  Emulator::Config config;
+  config.latency_ms = opts.latency_ms;
+  config.latency_jitter_ms = opts.latency_jitter_ms;
+  if (!emulator.start(config)) {
+    fprintf(stderr, "Failed to start the emulator\n");
+    return -1;
+  }
+
+  std::vector< RunResult > results;
+  Stats stats;
+  {
+    Firestore db;
+    ChromeTraceExporter tracer;
+    if (!opts.trace_path.empty())
+      db.setTracer(&tracer);
+    db.useEmulator(emulator.host());
+    db.configure("bench-project", "bench-api-key");
+
+    bool connected = false;
+    db.connectOrSignUp("bench@minifirestore.com", "bench-password", [&](Result& r) {
+      connected = !r.err;
+    });
+    while (!db.hasFinished())
+      db.update();
+    if (!connected) {
+      fprintf(stderr, "Failed to connect to the emulator\n");
+      return -1;
+    }
+
+    Bench bench(db, emulator, opts);
+    results = bench.runAll();
+    stats = db.stats();
+    db.setTracer(nullptr);
+    if (!opts.trace_path.empty())
+      tracer.save(opts.trace_path);
+  }
+
+  emulator.stop();
+  globalCleanup();
+
+  json jresults = {
+    {"config", {
+      {"requests", opts.requests},
+      {"latency_ms", opts.latency_ms},
+      {"latency_jitter_ms", opts.latency_jitter_ms},
+      {"server_rate", opts.server_rate},
+      {"rate_limit", opts.rate_limit},
+    }},
+    {"results", results},
+    {"stats", stats},
+  };
+  if (opts.json_path == "-") {
+    printf("%s\n", jresults.dump(2).c_str());
+  }
+  else if (!opts.json_path.empty()) {
+    FILE* f = fopen(opts.json_path.c_str(), "w");
+    if (!f) {
+      fprintf(stderr, "Failed to create %s\n", opts.json_path.c_str());
+      return -1;
+    }
+    fprintf(f, "%s\n", jresults.dump(2).c_str());
+    fclose(f);
+  }
+  return 0;
+}
@@ -0,0 +1,53 @@
+#include <cstdlib>
+#include <new>
+#include "bench_utils.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+// ----------------------------------
+// Count the allocations done by each thread, so the allocations done by
+// the emulator threads are not included in the numbers of the client
+static thread_local uint64_t thread_allocs = 0;
+
+void* operator new(size_t size) {
+  ++thread_allocs;
+  void* p = malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  free(p);
+}
+
+uint64_t threadAllocs() {
+  return thread_allocs;
+}
+
+double threadCpuSeconds() {
+#ifdef _WIN32
+  FILETIME creation, exit, kernel, user;
+  GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user);
+  auto toSecs = [](const FILETIME& ft) {
+    return (((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime) * 1e-7;
+  };
+  return toSecs(kernel) + toSecs(user);
+#else
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstdint>
+
+// Helpers shared by the benchmarks. Linking bench_utils.cpp replaces the global
+// operator new/delete to count the allocations done by each thread.
+
+// Allocations done by the calling thread so far
+uint64_t threadAllocs();
+
+// CPU time used by the calling thread
+double threadCpuSeconds();
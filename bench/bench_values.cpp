@@ -0,0 +1,382 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include "mini_firestore.h"
+#include "bench_utils.h"
+
+using namespace MiniFireStore;
+
+// Microbenchmarks of the conversion between plain json and the typed values
+// of the REST api (asValue/asDocument/fromValue/fromFields), which runs on
+// every request and answer.
+
+// ----------------------------------
+struct Options {
+  std::string fixtures_path = "bench/fixtures";
+  std::string filter;
+  int         min_time_ms = 200;
+  std::string json_path;
+};
+
+struct Shape {
+  const char* name;
+  int         depth;                    // Levels of nested maps
+  int         array_len;                // Items in each array field
+  int         string_size;              // Bytes in each string field
+  float       timestamp_density;        // Fraction of the string fields holding an ISO8601 timestamp
+  int         blob_size;                // Bytes of a binary field, sent as bytesValue. 0 for none
+};
+
+static const Shape shapes[] = {
+  { "flat",          0,   0,     16, 0.0f,      0 },
+  { "depth4",        4,   0,     16, 0.0f,      0 },
+  { "depth8",        8,   0,     16, 0.0f,      0 },
+  { "array64",       0,  64,     16, 0.0f,      0 },
+  { "array512",      0, 512,     16, 0.0f,      0 },
+  { "string1k",      0,   0,   1024, 0.0f,      0 },
+  { "string16k",     0,   0,  16384, 0.0f,      0 },
+  { "timestamps50",  0,   0,     16, 0.5f,      0 },
+  { "timestamps100", 0,   0,     16, 1.0f,      0 },
+  { "mixed",         3,  16,    128, 0.25f,     0 },
+  { "blob1k",        0,   0,     16, 0.0f,   1024 },
+  { "blob64k",       0,   0,     16, 0.0f,  65536 },
+};
+
+// Real answers of the REST api, as returned by :batchGet, :runQuery, list and get
+static const char* fixture_files[] = {
+  "batchGet_user.json",
+  "runQuery_orders.json",
+  "list_messages.json",
+  "get_game_state.json",
+};
+
+struct Measure {
+  std::string name;
+  std::string op;
+  size_t      fields = 0;               // Values converted in each iteration
+  uint64_t    iterations = 0;
+  double      seconds = 0.0;
+  uint64_t    allocs = 0;
+
+  double nsPerField() const { return seconds * 1e9 / (double)(iterations * fields); }
+  double allocsPerField() const { return (double)allocs / (double)(iterations * fields); }
+  double usPerIteration() const { return seconds * 1e6 / (double)iterations; }
+};
+
+static void to_json(json& j, const Measure& m) {
+  j = {
+    {"name", m.name},
+    {"op", m.op},
+    {"fields", m.fields},
+    {"iterations", m.iterations},
+    {"ns_per_field", m.nsPerField()},
+    {"allocs_per_field", m.allocsPerField()},
+    {"us_per_iteration", m.usPerIteration()},
+  };
+}
+
+// Prevents the compiler from discarding the results
+static volatile size_t sink = 0;
+
+// Runs fn for at least min_time_ms
+template< typename Fn >
+static Measure measure(const std::string& name, const char* op, size_t fields, int min_time_ms, Fn fn) {
+  // Warm up
+  sink = sink + fn();
+
+  Measure m;
+  m.name = name;
+  m.op = op;
+  m.fields = fields ? fields : 1;
+  uint64_t allocs0 = threadAllocs();
+  auto t0 = std::chrono::steady_clock::now();
+  auto min_time = std::chrono::milliseconds(min_time_ms);
+  uint64_t batch = 1;
+  while (true) {
+    for (uint64_t i = 0; i < batch; ++i)
+      sink = sink + fn();
+    m.iterations += batch;
+    auto elapsed = std::chrono::steady_clock::now() - t0;
+    if (elapsed >= min_time) {
+      m.seconds = std::chrono::duration<double>(elapsed).count();
+      break;
+    }
+    batch *= 2;
+  }
+  m.allocs = threadAllocs() - allocs0;
+  fprintf(stderr, "%-26s %-10s fields:%6zu  %9.1f ns/field  %6.2f allocs/field  %10.1f us/iter\n",
+    m.name.c_str(), m.op.c_str(), m.fields, m.nsPerField(), m.allocsPerField(), m.usPerIteration());
+  return m;
+}
+
+// Number of values in a plain json, not counting the root
+static size_t countFields(const json& j) {
+  size_t n = 0;
+  if (j.is_object() || j.is_array()) {
+    for (const json& child : j) {
+      n += 1 + countFields(child);
+    }
+  }
+  return n;
+}
+
+// ----------------------------------
+static json makeDoc(const Shape& shape, int depth, uint32_t& seed) {
+  auto rnd = [&seed]() {
+    seed = seed * 1664525u + 1013904223u;
+    return seed >> 8;
+  };
+  auto makeString = [&]() -> json {
+    if ((rnd() % 1000) < (uint32_t)(shape.timestamp_density * 1000.0f))
+      return timeToISO8601(1700000000 + rnd() % 10000000);
+    return std::string(shape.string_size, 'a' + rnd() % 26);
+  };
+
+  json doc = {
+    {"name", makeString()},
+    {"title", makeString()},
+    {"owner", makeString()},
+    {"score", (double)(rnd() % 10000) * 0.25},
+    {"count", (int)(rnd() % 1000)},
+    {"enabled", (rnd() & 1) == 0},
+    {"optional", nullptr},
+  };
+  if (shape.array_len) {
+    json values = json::value_t::array;
+    json names = json::value_t::array;
+    for (int i = 0; i < shape.array_len; ++i) {
+      values.push_back((int)(rnd() % 1000));
+      names.push_back(makeString());
+    }
+    doc["values"] = values;
+    doc["names"] = names;
+  }
+  if (shape.blob_size) {
+    json::binary_t blob(std::vector< uint8_t >(shape.blob_size));
+    for (uint8_t& b : blob)
+      b = (uint8_t)rnd();
+    doc["blob"] = json::binary(std::move(blob));
+  }
+  if (depth > 0)
+    doc["child"] = makeDoc(shape, depth - 1, seed);
+  return doc;
+}
+
+// Returns the documents found in an answer of the REST api
+static std::vector< json > documentsOf(const json& answer) {
+  std::vector< json > docs;
+  if (answer.is_array()) {
+    for (const json& item : answer) {
+      if (item.contains("found"))
+        docs.push_back(item["found"]);
+      else if (item.contains("document"))
+        docs.push_back(item["document"]);
+    }
+  }
+  else if (answer.contains("documents")) {
+    for (const json& item : answer["documents"])
+      docs.push_back(item);
+  }
+  else if (answer.contains("fields")) {
+    docs.push_back(answer);
+  }
+  return docs;
+}
+
+static bool loadFile(const std::string& path, std::string& out) {
+  FILE* f = fopen(path.c_str(), "rb");
+  if (!f)
+    return false;
+  char buf[16384];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    out.append(buf, n);
+  fclose(f);
+  return true;
+}
+
+// ----------------------------------
+// A struct with a schema, converted through json and with the direct codec of MINI_FIRESTORE_DEFINE
+struct BenchItem {
+  std::string name;
+  int         count = 0;
+};
+MINI_FIRESTORE_DEFINE(BenchItem, name, count)
+
+struct BenchPlayer {
+  int64_t                  id = 0;
+  std::string              nick;
+  double                   score = 0.0;
+  bool                     online = false;
+  Timestamp                last_seen;
+  std::vector< BenchItem > inventory;
+};
+MINI_FIRESTORE_DEFINE(BenchPlayer, id, nick, score, online, last_seen, inventory)
+
+static BenchPlayer makePlayer(int num_items) {
+  BenchPlayer p;
+  p.id = 9007199254740993LL;
+  p.nick = "player_one";
+  p.score = 1234.5;
+  p.online = true;
+  p.last_seen = Timestamp(1700000000, 123000000);
+  for (int i = 0; i < num_items; ++i) {
+    BenchItem item;
+    item.name = "item" + std::to_string(i);
+    item.count = i;
+    p.inventory.push_back(item);
+  }
+  return p;
+}
+
+// ----------------------------------
+static bool matches(const Options& opts, const char* name) {
+  return opts.filter.empty() || strstr(name, opts.filter.c_str()) != nullptr;
+}
+
+static void benchShapes(const Options& opts, std::vector< Measure >& results) {
+  for (const Shape& shape : shapes) {
+    if (!matches(opts, shape.name))
+      continue;
+    uint32_t seed = 1234;
+    json plain = makeDoc(shape, shape.depth, seed);
+    json encoded = asDocument(plain);
+    size_t fields = countFields(plain);
+
+    results.push_back(measure(shape.name, "encode", fields, opts.min_time_ms, [&]() {
+      return asDocument(plain).size();
+    }));
+    results.push_back(measure(shape.name, "decode", fields, opts.min_time_ms, [&]() {
+      return fromFields(encoded).size();
+    }));
+  }
+}
+
+static void benchSchemas(const Options& opts, std::vector< Measure >& results) {
+  const int item_counts[] = { 4, 64 };
+  for (int num_items : item_counts) {
+    std::string name = "schema_items" + std::to_string(num_items);
+    if (!matches(opts, name.c_str()))
+      continue;
+    BenchPlayer player = makePlayer(num_items);
+    json plain = player;
+    json encoded = asDocument(plain);
+    size_t fields = countFields(plain);
+
+    // The text of the body is the output in both cases
+    results.push_back(measure(name, "enc_json", fields, opts.min_time_ms, [&]() {
+      return asDocument(json(player)).dump().size();
+    }));
+    results.push_back(measure(name, "enc_schema", fields, opts.min_time_ms, [&]() {
+      std::string out;
+      Schema::encodeFields(out, player);
+      return out.size();
+    }));
+    results.push_back(measure(name, "dec_json", fields, opts.min_time_ms, [&]() {
+      return fromFields(encoded).get< BenchPlayer >().inventory.size();
+    }));
+    results.push_back(measure(name, "dec_schema", fields, opts.min_time_ms, [&]() {
+      BenchPlayer p;
+      Schema::decodeFields(encoded["fields"], p);
+      return p.inventory.size();
+    }));
+  }
+}
+
+static bool benchFixtures(const Options& opts, std::vector< Measure >& results) {
+  for (const char* file : fixture_files) {
+    if (!matches(opts, file))
+      continue;
+    std::string path = opts.fixtures_path + "/" + file;
+    std::string text;
+    if (!loadFile(path, text)) {
+      fprintf(stderr, "Failed to read fixture %s\n", path.c_str());
+      return false;
+    }
+    json answer = json::parse(text, nullptr, false);
+    std::vector< json > docs = documentsOf(answer);
+    if (answer.is_discarded() || docs.empty()) {
+      fprintf(stderr, "Fixture %s has no documents\n", path.c_str());
+      return false;
+    }
+
+    std::vector< json > plain_docs;
+    size_t fields = 0;
+    for (const json& doc : docs) {
+      plain_docs.push_back(fromFields(doc));
+      fields += countFields(plain_docs.back());
+    }
+
+    // parse: the text of the answer to json, decode: the typed values to plain json
+    results.push_back(measure(file, "parse", fields, opts.min_time_ms, [&]() {
+      return json::parse(text).size();
+    }));
+    results.push_back(measure(file, "decode", fields, opts.min_time_ms, [&]() {
+      size_t n = 0;
+      for (const json& doc : docs)
+        n += fromFields(doc).size();
+      return n;
+    }));
+    results.push_back(measure(file, "encode", fields, opts.min_time_ms, [&]() {
+      size_t n = 0;
+      for (const json& doc : plain_docs)
+        n += asDocument(doc).size();
+      return n;
+    }));
+  }
+  return true;
+}
+
+// ----------------------------------
+static void usage() {
+  printf("bench_values_app [options]\n");
+  printf("  --fixtures=bench/fixtures Folder with the captured answers\n");
+  printf("  --filter=name             Only run the shapes/fixtures containing name\n");
+  printf("  --min-time-ms=200         Minimum time measuring each case\n");
+  printf("  --json=path               Save the results as json. Use - for stdout\n");
+}
+
+int main(int argc, char** argv) {
+  Options opts;
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    const char* eq = strchr(arg, '=');
+    std::string key = eq ? std::string(arg, eq - arg) : std::string(arg);
+    const char* value = eq ? eq + 1 : "";
+    if (key == "--fixtures") opts.fixtures_path = value;
+    else if (key == "--filter") opts.filter = value;
+    else if (key == "--min-time-ms") opts.min_time_ms = atoi(value);
+    else if (key == "--json") opts.json_path = value;
+    else {
+      usage();
+      return key == "--help" ? 0 : -1;
+    }
+  }
+
+  std::vector< Measure > results;
+  benchShapes(opts, results);
+  benchSchemas(opts, results);
+  if (!benchFixtures(opts, results))
+    return -1;
+
+  json jresults = {
+    {"config", {
+      {"min_time_ms", opts.min_time_ms},
+    }},
+    {"results", results},
+  };
+  if (opts.json_path == "-") {
+    printf("%s\n", jresults.dump(2).c_str());
+  }
+  else if (!opts.json_path.empty()) {
+    FILE* f = fopen(opts.json_path.c_str(), "w");
+    if (!f) {
+      fprintf(stderr, "Failed to create %s\n", opts.json_path.c_str());
+      return -1;
+    }
+    fprintf(f, "%s\n", jresults.dump(2).c_str());
+    fclose(f);
+  }
+  return 0;
+}
@@ -1,10 +1,15 @@
 #include <cassert>
 #include <cstdio>
+#include <cstring>
 #include "mini_firestore.h"
+#include "mini_firestore_emulator.h"
 #include "demo_credentials.h"
 
 using namespace MiniFireStore;
 
+// The emulator starts empty, so the query tests need to add the docs first
+static bool add_query_docs = false;
+
 struct Person {
   int age = 32;
   std::string name = "john";
@@ -84,6 +89,175 @@ void from_json(const json& j, School& p) {
   p.is_private = j.value("is_private", p.is_private);
 }
 
+// ----------------------------------
+// Schemas generate the to_json/from_json, and write/read the api values directly
+struct Item {
+  std::string name;
+  int         count = 0;
+  Item() = default;
+  Item(const std::string& new_name, int new_count) : name(new_name), count(new_count) {}
+  bool operator==(const Item& i) const { return name == i.name && count == i.count; }
+};
+MINI_FIRESTORE_DEFINE(Item, name, count)
+
+struct Player {
+  int64_t             id = 0;
+  std::string         nick;
+  double              score = 0.0;
+  bool                online = false;
+  Timestamp           last_seen;
+  std::vector< Item > inventory;
+  json::binary_t      save;
+  bool operator==(const Player& p) const {
+    return id == p.id && nick == p.nick && score == p.score && online == p.online
+      && last_seen == p.last_seen && inventory == p.inventory && save.size() == p.save.size() && std::equal(save.begin(), save.end(), p.save.begin());
+  }
+};
+MINI_FIRESTORE_DEFINE(Player, id, nick, score, online, last_seen, inventory, save)
+
+void testSchema(Firestore& db) {
+  Player p;
+  p.id = 9007199254740993LL;
+  p.nick = "fred \"the\" player";
+  p.score = 12.75;
+  p.online = true;
+  parseTimestamp("2022-04-15T14:25:30.123456Z", &p.last_seen);
+  p.inventory = { { "sword", 1 }, { "potion", 5 } };
+  p.save = json::binary_t(std::vector< uint8_t >{ 0, 1, 2, 250, 255 });
+
+  Ref ref = db.ref("users").child(db.uid()).child("tests/player");
+  ref.write(p, [=](Result& r) {
+    assert(!r.err);
+    ref.readFields([=](Result& r) {
+      Player p2;
+      bool is_ok = r.get(p2);
+      printf("Player read back with the schema: %s\n", json(p2).dump().c_str());
+      assert(is_ok && p2 == p);
+      });
+    // Also as plain json, with the generated from_json
+    ref.read([=](Result& r) {
+      Player p3;
+      assert(r.get(p3) && p3 == p);
+      });
+    });
+  while (!db.hasFinished()) db.update();
+}
+
+// Writes some docs in parallel, reads them back, and writes a summary, without nesting callbacks
+void testFutures(Firestore& db) {
+  Ref coll = db.ref("users").child(db.uid()).child("scores");
+  Ref summary = db.ref("users").child(db.uid()).child("tests/summary");
+  const int num_docs = 10;
+  std::vector< Future > writes;
+  for (int i = 0; i < num_docs; ++i)
+    writes.push_back(coll.child("doc" + std::to_string(i)).write({ {"score", i * 10} }));
+
+  bool done = false;
+  when_all(writes).then([=](Result& r) {
+    assert(!r.err);
+    std::vector< Future > reads;
+    for (int i = 0; i < num_docs; ++i)
+      reads.push_back(coll.child("doc" + std::to_string(i)).read());
+    return when_all(reads);
+  }).then([=](Result& r) {
+    int total = 0;
+    for (const json& doc : r.j)
+      total += doc["score"].get<int>();
+    return summary.write({ {"total", total} });
+  }).then([=](Result& r) {
+    return summary.read();
+  }).then([&](Result& r) {
+    printf("Summary: %s\n", r.j.dump().c_str());
+    assert(r.j["total"] == 450);
+    done = true;
+  });
+
+  // The first to answer wins
+  std::vector< Future > reads = { coll.child("doc1").read(), coll.child("doc2").read() };
+  when_any(reads).then([](Result& r) {
+    assert(!r.err && r.j.contains("score"));
+  });
+
+  while (!db.hasFinished()) db.update();
+  assert(done);
+}
+
+#if MINI_FIRESTORE_COROUTINES
+// The loop over the pages of listAll, written as a coroutine
+Task listPages(Ref coll, int page_size) {
+  Result all = co_await coll.list(page_size);
+  std::string token = all.j.value("nextPageToken", "");
+  while (!all.err && !token.empty()) {
+    Result page = co_await coll.list(page_size, token.c_str());
+    for (json& doc : page.j["documents"])
+      all.j["documents"].push_back(std::move(doc));
+    token = page.j.value("nextPageToken", "");
+  }
+  co_return all;
+}
+
+Task sumScores(Ref coll) {
+  Result r = co_await listPages(coll, 3);
+  int total = 0;
+  for (const json& doc : r.j["documents"])
+    total += std::stoi(doc["fields"]["score"]["integerValue"].get<std::string>());
+  r.j = total;
+  co_return r;
+}
+
+Task readScore(Ref doc) {
+  Result r = co_await doc.read();
+  r.j = r.err ? 0 : r.j["score"].get<int>();
+  co_return r;
+}
+
+// Awaits a read and a Task
+Task sumTwoScores(Ref coll) {
+  Result a = co_await coll.child("doc1").read();
+  Result b = co_await readScore(coll.child("doc2"));
+  assert(!a.err && !b.err);
+  a.j = a.j["score"].get<int>() + b.j.get<int>();
+  co_return a;
+}
+
+void testCoroutines(Firestore& db) {
+  Ref coll = db.ref("users").child(db.uid()).child("scores");
+  bool done = false;
+  Future total = sumScores(coll);
+  total.then([&](Result& r) {
+    printf("Total from the coroutines: %s\n", r.j.dump().c_str());
+    assert(!r.err && r.j == 450);
+    done = true;
+  });
+
+  bool two_done = false;
+  sumTwoScores(coll).future().then([&](Result& r) {
+    assert(!r.err && r.j == 30);
+    two_done = true;
+  });
+
+  // listAll is also a coroutine in this build
+  bool listed = false;
+  coll.listAll([&](Result& r) {
+    assert(!r.err && r.j["documents"].size() == 10);
+    listed = true;
+  });
+
+  // A continuation returning a Task waits for the coroutine
+  bool chained = false;
+  coll.child("doc1").read().then([=](Result& r) {
+    assert(!r.err);
+    return sumScores(coll);
+  }).then([&](Result& r) {
+    assert(!r.err && r.j == 450);
+    chained = true;
+  });
+
+  while (!db.hasFinished()) db.update();
+  assert(done && two_done && listed && chained);
+}
+#endif
+
 void testDelete(MiniFireStore::Firestore& db) {
   printf("test Delete begins...\n");
   Ref r = db.ref("free/James");
@@ -245,7 +419,7 @@ void testQuery(MiniFireStore::Firestore& db) {
   Ref r = db.ref("free");
 
   // Add some elements
-  if (0) {
+  if (add_query_docs) {
     for (auto p : people) {
       r.add(p, [&](const Result& res) {
         std::string new_id = res.added_id;
@@ -253,10 +427,12 @@ void testQuery(MiniFireStore::Firestore& db) {
         printf("NewID: %s\n", new_id.c_str());
         });
     }
+    while (!db.hasFinished()) db.update();
   }
 
   auto checkQuery = [](const Result& result, int expected_result, const char* title) {
     assert(!result.err);
+    assert(result.update_times.size() == result.j.size());
     for (auto& jp : result.j) {
       Person rp = jp.get<Person>();
       std::string id = jp.value("id", "");
@@ -365,6 +541,113 @@ void testInc(MiniFireStore::Firestore& db) {
   while (!db.hasFinished()) db.update();
 }
 
+void testUpdate(MiniFireStore::Firestore& db) {
+  Ref ref = db.ref("players").child(db.uid());
+  ref.write({ {"name", "fred"}, {"stats", {{"hp", 100}, {"mp", 5}}}, {"tags", {"new"}}, {"tmp", true} }, [](Result& r) {});
+  while (!db.hasFinished()) db.update();
+
+  // All the changes of a tick in a single write
+  UpdateSpec spec;
+  spec.set("pos.x", 10).set("pos.y", 20).remove("tmp")
+    .increment("stats.hp", -7).minimum("stats.mp", 2).maximum("best_score", 50)
+    .serverTimestamp("last_seen").arrayUnion("tags", { "veteran" }).arrayRemove("tags", { "new" });
+  ref.update(spec, [=](Result& r) {
+    printf("Updated: %s\n", r.j.dump().c_str());
+    assert(!r.err);
+    ref.read([=](Result& r) {
+      printf("Read back: %s\n", r.j.dump().c_str());
+      assert(r.j["pos"]["x"] == 10 && r.j["stats"]["hp"] == 93 && r.j["stats"]["mp"] == 2);
+      assert(!r.j.contains("tmp") && r.j["tags"] == json({ "veteran" }));
+      });
+    });
+  while (!db.hasFinished()) db.update();
+
+  // Single values are sent as arrays of one element
+  UpdateSpec single;
+  single.arrayUnion("tags", "elite").arrayRemove("tags", "veteran");
+  ref.update(single, [=](Result& r) {
+    assert(!r.err);
+    ref.read([=](Result& r) {
+      assert(r.j["tags"] == json::array({ "elite" }));
+      });
+    });
+  while (!db.hasFinished()) db.update();
+}
+
+// The preconditions are checked by the server, which answers with the grpc status of the failure
+void testPreconditions(Firestore& db) {
+  Ref coll = db.ref("users").child(db.uid()).child("guarded");
+  Ref ref = coll.child("doc");
+  Ref missing = coll.child("missing");
+  int num_checks = 0;
+  ref.del([=, &num_checks](Result& r) {
+    ref.create({ {"v", 1} }, [=, &num_checks](Result& r) {
+      assert(!r.err && !r.update_time.empty());
+      std::string first_time = r.update_time;
+      ref.create({ {"v", 1} }, [&num_checks](Result& r) {
+        assert(r.err && r.grpc_status == "ALREADY_EXISTS");
+        ++num_checks;
+        });
+      ref.writeIf({ {"v", 2} }, first_time, [=, &num_checks](Result& r) {
+        assert(!r.err && !r.update_time.empty() && r.update_time != first_time);
+        ++num_checks;
+        // Modified after first_time
+        ref.writeIf({ {"v", 3} }, first_time, [=, &num_checks](Result& r) {
+          assert(r.err && r.grpc_status == "FAILED_PRECONDITION");
+          ++num_checks;
+          ref.read([&num_checks](Result& r) {
+            assert(!r.err && r.j["v"] == 2 && !r.update_time.empty());
+            ++num_checks;
+            });
+          });
+        });
+      });
+    });
+  missing.updateIfExists({ {"v", 1} }, [&num_checks](Result& r) {
+    assert(r.err && r.grpc_status == "NOT_FOUND");
+    ++num_checks;
+    });
+  while (!db.hasFinished()) db.update();
+  printf("Preconditions: %d checks\n", num_checks);
+  assert(num_checks == 5);
+}
+
+void testTransaction(MiniFireStore::Firestore& db) {
+  Ref from = db.ref("accounts").child(db.uid() + "_a");
+  Ref to = db.ref("accounts").child(db.uid() + "_b");
+  from.write({ {"balance", 100} }, [](Result& r) {});
+  to.write({ {"balance", 0} }, [](Result& r) {});
+  while (!db.hasFinished()) db.update();
+
+  // Several transfers at the same time. The ones reading stale balances are retried
+  const int num_transfers = 5;
+  for (int i = 0; i < num_transfers; ++i) {
+    db.runTransaction([=](Transaction tr) {
+      tr.read(from, [=](Result& rf) {
+        tr.read(to, [=](Result& rt) {
+          if (rf.err || rt.err) {
+            tr.abort();
+            return;
+          }
+          tr.write(from, { {"balance", rf.j["balance"].get<int>() - 10} });
+          tr.write(to, { {"balance", rt.j["balance"].get<int>() + 10} });
+          tr.commit();
+          });
+        });
+      }, [=](Result& r) {
+        printf("Transfer %d %s\n", i, r.err ? "failed" : "done");
+        assert(!r.err);
+      }, 10);
+  }
+  while (!db.hasFinished()) db.update();
+
+  from.read([=](Result& r) {
+    printf("Balance after the transfers: %s\n", r.j.dump().c_str());
+    assert(r.j["balance"] == 100 - num_transfers * 10);
+    });
+  while (!db.hasFinished()) db.update();
+}
+
 void testTime(MiniFireStore::Firestore& db) {
 
   time_t now = time(nullptr);
@@ -377,6 +660,10 @@ void testTime(MiniFireStore::Firestore& db) {
     assert(false);
   }
 
+  Timestamp ts;
+  is_ok = parseTimestamp("2022-04-15T16:25:30.123456789+02:00", &ts);
+  assert(is_ok && json(ts) == "2022-04-15T14:25:30.123456789Z");
+
   Ref ref = db.ref("users").child(db.uid()).child("tests/time_conversions");
   ref.read([=](Result& r) {
     printf("time read result.j=%s\n", r.j.dump().c_str());
@@ -405,6 +692,85 @@ void testTime(MiniFireStore::Firestore& db) {
   while (!db.hasFinished()) db.update();
 }
 
+void testBytes(Firestore& db) {
+  std::vector< uint8_t > blob(1000);
+  for (size_t i = 0; i < blob.size(); ++i)
+    blob[i] = (uint8_t)(i * 7);
+  Ref ref = db.ref("users").child(db.uid()).child("tests/bytes");
+  ref.write({ {"save", json::binary(blob)} }, [=](Result& r) {
+    assert(!r.err);
+    ref.read([=](Result& r) {
+      printf("Bytes read back: %d\n", r.j["save"].is_binary() ? (int)r.j["save"].get_binary().size() : -1);
+      assert(r.j["save"].is_binary() && std::equal(blob.begin(), blob.end(), r.j["save"].get_binary().begin()));
+      });
+    });
+  while (!db.hasFinished()) db.update();
+}
+
+// A large doc travels compressed both ways. Without zlib, only the answers can be compressed
+void testCompression(Firestore& db) {
+  json doc = { {"text", std::string()}, {"scores", json::array()} };
+  for (int i = 0; i < 2000; ++i) {
+    doc["text"].get_ref< std::string& >() += "the quick brown fox " + std::to_string(i % 10) + " ";
+    doc["scores"].push_back(i % 100);
+  }
+
+#ifdef MINI_FIRESTORE_ZLIB
+  db.setCompression(true, 1024);
+#else
+  db.setCompression(true);
+#endif
+  Ref ref = db.ref("users").child(db.uid()).child("tests/compressed");
+  ref.write(doc, [=](Result& r) {
+    assert(!r.err);
+    printf("Compressed write: %d bytes, %d on the wire\n", (int)r.bytes_sent, (int)r.bytes_sent_wire);
+#ifdef MINI_FIRESTORE_ZLIB
+    assert(r.bytes_sent_wire < r.bytes_sent / 4);
+#endif
+    ref.read([=](Result& r) {
+      assert(!r.err && r.j == doc);
+      printf("Compressed read: %d bytes, %d on the wire\n", (int)r.bytes_recv, (int)r.bytes_recv_wire);
+#ifdef MINI_FIRESTORE_ZLIB
+      assert(r.bytes_recv_wire < r.bytes_recv / 4);
+#endif
+      });
+    });
+  while (!db.hasFinished()) db.update();
+  db.setCompression(false);
+}
+
+// A body prepared once is committed several times at once. The requests keep it alive after the caller drops it
+void testPreparedWrites(Firestore& db) {
+  Ref ref = db.ref("users").child(db.uid()).child("tests/prepared");
+  json doc = { {"name", "prepared"}, {"text", std::string(4096, 'x')} };
+  for (int compressed = 0; compressed < 2; ++compressed) {
+#ifdef MINI_FIRESTORE_ZLIB
+    db.setCompression(compressed != 0, compressed ? 1024 : 0);
+#endif
+    int num_done = 0;
+    {
+      SharedBody body = ref.prepareWrite(doc);
+#ifdef MINI_FIRESTORE_ZLIB
+      assert(body->gzip.empty() == !compressed);
+#endif
+      for (int i = 0; i < 4; ++i) {
+        ref.commit(body, [&](Result& r) {
+          assert(!r.err && !r.update_time.empty());
+          ++num_done;
+          });
+      }
+      // Only the requests on the fly hold it now
+    }
+    while (!db.hasFinished()) db.update();
+    assert(num_done == 4);
+    ref.read([=](Result& r) {
+      assert(!r.err && r.j == doc);
+      });
+    while (!db.hasFinished()) db.update();
+  }
+  db.setCompression(false);
+}
+
 void testList(Firestore& db) {
   Ref ref = db.ref("users").child(db.uid());
   ref.list([](Result& r) {
@@ -530,6 +896,104 @@ void testListLarge(Firestore& db) {
   while (!db.hasFinished()) db.update();
 }
 
+// Several users, each with its own session, sending their requests through the same connections
+void testSharedTransport(const std::string& emulator_host) {
+  const int num_sessions = 4;
+  Transport transport;
+  std::vector< std::unique_ptr< Firestore > > sessions;
+  int num_done = 0;
+  for (int i = 0; i < num_sessions; ++i) {
+    sessions.emplace_back(new Firestore());
+    Firestore& db = *sessions.back();
+    db.setTransport(&transport);
+    db.useEmulator(emulator_host);
+    db.configure("demo-project", "demo-api-key");
+    std::string email = "user" + std::to_string(i) + "@minifirestore.com";
+    db.connectOrSignUp(email, "shared-password", [&, i](Result& r) {
+      assert(!r.err);
+      Ref ref = db.ref("users").child(db.uid()).child("tests/session");
+      ref.write({ {"session", i} }, [&, ref, i](Result& r) {
+        assert(!r.err);
+        ref.read([&, i](Result& r) {
+          assert(!r.err && r.j["session"] == i);
+          ++num_done;
+          });
+        });
+      });
+  }
+  assert(transport.numSessions() == num_sessions);
+  while (!transport.hasFinished()) {
+    if (!transport.update())
+      transport.wait(10);
+  }
+  printf("Shared transport: %d/%d sessions done\n", num_done, num_sessions);
+  assert(num_done == num_sessions);
+  sessions.clear();
+  assert(transport.numSessions() == 0);
+}
+
+static const Stats::Op* findOp(const Stats& stats, const char* label) {
+  for (auto& op : stats.ops)
+    if (op.label == label)
+      return &op;
+  return nullptr;
+}
+
+// Short lived tokens are refreshed before they expire, and when the server rejects all the tokens in the
+// middle of the traffic, the requests are held during the refresh and replayed once. No callback sees an error
+void testTokenRefresh(Emulator& emulator) {
+  Emulator::Config cfg = emulator.config();
+  Emulator::Config short_tokens = cfg;
+  short_tokens.token_expires_in_secs = 2;
+  emulator.setConfig(short_tokens);
+
+  Firestore db;
+  db.useEmulator(emulator.host());
+  db.configure("demo-project", "demo-api-key");
+  bool connected = false;
+  db.connectOrSignUp("tokens@minifirestore.com", "tokens-password", [&](Result& r) {
+    assert(!r.err);
+    connected = true;
+    });
+  while (!db.hasFinished()) db.update();
+  assert(connected);
+
+  Ref coll = db.ref("users").child(db.uid()).child("tokens");
+  auto start = std::chrono::steady_clock::now();
+  auto elapsed_ms = [&]() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  };
+  int num_sent = 0;
+  int num_done = 0;
+  int num_errors = 0;
+  bool expired = false;
+  while (elapsed_ms() < 2500 || !db.hasFinished()) {
+    if (elapsed_ms() < 2500 && num_sent - num_done < 4) {
+      coll.child("doc" + std::to_string(num_sent % 4)).write({ {"n", num_sent} }, [&](Result& r) {
+        if (r.err)
+          ++num_errors;
+        ++num_done;
+        });
+      ++num_sent;
+    }
+    if (!expired && elapsed_ms() > 1500) {
+      emulator.expireTokens();
+      expired = true;
+    }
+    db.update();
+  }
+
+  Stats stats = db.stats();
+  const Stats::Op* refresh = findOp(stats, "refresh");
+  const Stats::Op* write = findOp(stats, "write");
+  printf("Token refresh: %d writes, %d errors, %d refreshes, %d replays\n", num_done, num_errors,
+    refresh ? (int)refresh->requests : 0, write ? (int)write->replays : 0);
+  assert(num_done == num_sent && num_errors == 0);
+  assert(refresh && refresh->requests >= 2 && refresh->errors == 0);
+  assert(write && write->replays >= 1);
+  emulator.setConfig(cfg);
+}
+
 class MySample {
 public:
   void myLog(MiniFireStore::eLevel level, const char* msg) {
@@ -546,14 +1010,41 @@ int main(int argc, char** argv)
   MiniFireStore::setLogCallback(std::bind(&MySample::myLog, &s, std::placeholders::_1, std::placeholders::_2));
   MiniFireStore::setLogLevel(eLevel::Log);
 
+  // Run against a local emulator instead of the real db
+  bool use_emulator = argc > 1 && strcmp(argv[1], "--emulator") == 0;
+  Emulator emulator;
+
   Firestore db;
-  db.configure(db_name, api_key);  // Defined in demo_credentials.h
+  if (use_emulator) {
+    if (!emulator.start()) {
+      printf("Failed to start the emulator\n");
+      return -1;
+    }
+    printf("Using emulator at %s\n", emulator.host().c_str());
+    db.useEmulator(emulator.host());
+    db.configure("demo-project", "demo-api-key");
+    add_query_docs = true;
+  }
+  else {
+    db.configure(db_name, api_key);  // Defined in demo_credentials.h
+  }
 
   auto runTests = [&db]() {
     testTime(db);
+    testBytes(db);
+    testCompression(db);
+    testPreparedWrites(db);
+    testSchema(db);
+    testFutures(db);
+#if MINI_FIRESTORE_COROUTINES
+    testCoroutines(db);
+#endif
     testPatch(db);
     testList(db);
     testInc(db);
+    testUpdate(db);
+    testPreconditions(db);
+    testTransaction(db);
     testSubCollections(db);
     testDelete(db);
     testReadWriteDelete(db);
@@ -562,6 +1053,9 @@ int main(int argc, char** argv)
     testListLarge(db);
   };
 
+  // The connections for the first requests open while the login is in flight
+  db.prewarm(2);
+
   db.connectOrSignUp(user_email, user_password, [&](Result& result) {
     if (result.err)
       printf("Connect failed: %s\n", result.j.dump().c_str());
@@ -573,6 +1067,16 @@ int main(int argc, char** argv)
     db.update();
   }
 
+  if (use_emulator) {
+    testSharedTransport(emulator.host());
+    testTokenRefresh(emulator);
+  }
+
+  for (auto& op : db.stats().ops)
+    printf("%-10s %4llu requests %3llu errors  p50:%7lluus  p99:%7lluus\n", op.label.c_str(),
+      (unsigned long long)op.requests, (unsigned long long)op.errors,
+      (unsigned long long)op.total.percentile(0.5), (unsigned long long)op.total.percentile(0.99));
+
   printf("Ending\n");
 
   MiniFireStore::globalCleanup();
@@ -0,0 +1,1494 @@
+#include <cstdio>
+#include <cstring>
+#include <cassert>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "mini_firestore_emulator.h"
+#include "mini_firestore.h"
+
+#ifdef MINI_FIRESTORE_ZLIB
+extern "C" {
+#include <zlib.h>
+}
+#endif
+
+// Sockets
+#ifdef _WIN32
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef SOCKET socket_t;
+typedef int    socklen_t;
+#define SEND_FLAGS 0
+
+#else
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+typedef int socket_t;
+#define INVALID_SOCKET (-1)
+#define closesocket close
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+#endif
+
+namespace MiniFireStore
+{
+  namespace EmulatorCtes {
+    const char* firestore_prefix = "/v1/";
+    const char* documents_key = "/documents";
+    const char* sign_in_path = "/identitytoolkit.googleapis.com/v1/accounts:signInWithPassword";
+    const char* sign_up_path = "/identitytoolkit.googleapis.com/v1/accounts:signUp";
+    const char* refresh_token_path = "/securetoken.googleapis.com/v1/token";
+    const int   default_page_size = 20;
+    const size_t min_gzip_answer_size = 256;
+  }
+
+  // -----------------------------------------
+  struct HttpRequest {
+    std::string method;
+    std::string path;
+    std::vector< std::pair< std::string, std::string > > params;
+    std::unordered_map< std::string, std::string > headers;       // Lowercase names
+    std::string body;
+
+    std::string header(const char* name) const {
+      auto it = headers.find(name);
+      return it == headers.end() ? std::string() : it->second;
+    }
+
+    std::string param(const char* name) const {
+      for (auto& p : params)
+        if (p.first == name)
+          return p.second;
+      return std::string();
+    }
+
+    std::vector< std::string > params_named(const char* name) const {
+      std::vector< std::string > values;
+      for (auto& p : params)
+        if (p.first == name)
+          values.push_back(p.second);
+      return values;
+    }
+  };
+
+  struct HttpResponse {
+    int         status = 200;
+    std::string body;
+    int         retry_after_secs = 0;       // Sent as a Retry-After header when > 0
+  };
+
+  static const char* statusText(int status) {
+    switch (status) {
+    case 100: return "Continue";
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 404: return "Not Found";
+    case 409: return "Conflict";
+    case 411: return "Length Required";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+    }
+    return "Unknown";
+  }
+
+  static HttpResponse jsonResponse(const json& j) {
+    HttpResponse res;
+    res.body = j.dump();
+    return res;
+  }
+
+  // Same format used by the google apis. The auth apis don't send the status
+  static HttpResponse errorResponse(int code, const char* status, const std::string& message) {
+    json jerr = { {"code", code}, {"message", message} };
+    if (status)
+      jerr["status"] = status;
+    HttpResponse res = jsonResponse({ {"error", jerr} });
+    res.status = code;
+    return res;
+  }
+
+  static std::string urlDecode(const std::string& s) {
+    std::string out;
+    out.reserve(s.size());
+    for (size_t i = 0; i < s.size(); ++i) {
+      if (s[i] == '%' && i + 2 < s.size()) {
+        char hex[3] = { s[i + 1], s[i + 2], 0 };
+        out.push_back((char)strtol(hex, nullptr, 16));
+        i += 2;
+      }
+      else if (s[i] == '+') {
+        out.push_back(' ');
+      }
+      else {
+        out.push_back(s[i]);
+      }
+    }
+    return out;
+  }
+
+  static void parseParams(const std::string& query, std::vector< std::pair< std::string, std::string > >& params) {
+    size_t pos = 0;
+    while (pos < query.size()) {
+      size_t end = query.find_first_of("&?", pos);
+      if (end == std::string::npos)
+        end = query.size();
+      std::string kv = query.substr(pos, end - pos);
+      size_t eq = kv.find('=');
+      if (eq == std::string::npos)
+        params.emplace_back(urlDecode(kv), std::string());
+      else
+        params.emplace_back(urlDecode(kv.substr(0, eq)), urlDecode(kv.substr(eq + 1)));
+      pos = end + 1;
+    }
+  }
+
+  static bool startsWith(const std::string& s, const std::string& prefix) {
+    return s.size() >= prefix.size() && s.compare(0, prefix.size(), prefix) == 0;
+  }
+
+  static int countSegments(const std::string& path) {
+    if (path.empty())
+      return 0;
+    int n = 1;
+    for (char c : path)
+      if (c == '/')
+        ++n;
+    return n;
+  }
+
+  // -----------------------------------------
+  // Compares two RFC3339 timestamps, which might have a different number of decimals or offsets.
+  // Uses the same codec as the library
+  static int compareTimestamps(const std::string& a, const std::string& b) {
+    Timestamp ta, tb;
+    if (!parseTimestamp(a, &ta) || !parseTimestamp(b, &tb)) {
+      int c = a.compare(b);
+      return c < 0 ? -1 : (c > 0 ? 1 : 0);
+    }
+    return ta < tb ? -1 : (tb < ta ? 1 : 0);
+  }
+
+  // -----------------------------------------
+  // Firestore typed values
+  static int typeOrder(const json& v) {
+    if (v.contains("nullValue")) return 0;
+    if (v.contains("booleanValue")) return 1;
+    if (v.contains("integerValue") || v.contains("doubleValue")) return 2;
+    if (v.contains("timestampValue")) return 3;
+    if (v.contains("stringValue")) return 4;
+    if (v.contains("bytesValue")) return 5;
+    if (v.contains("referenceValue")) return 6;
+    if (v.contains("geoPointValue")) return 7;
+    if (v.contains("arrayValue")) return 8;
+    if (v.contains("mapValue")) return 9;
+    return 10;
+  }
+
+  static bool isInteger(const json& v) {
+    return v.contains("integerValue");
+  }
+
+  static int64_t integerOf(const json& v) {
+    const json& jv = v["integerValue"];
+    if (jv.is_string())
+      return strtoll(jv.get_ref< const std::string& >().c_str(), nullptr, 10);
+    return jv.get<int64_t>();
+  }
+
+  static double numberOf(const json& v) {
+    if (isInteger(v))
+      return (double)integerOf(v);
+    const json& jv = v["doubleValue"];
+    if (jv.is_string())
+      return strtod(jv.get_ref< const std::string& >().c_str(), nullptr);
+    return jv.get<double>();
+  }
+
+  static const json& arrayValues(const json& v) {
+    static const json empty = json::array();
+    const json& arr = v["arrayValue"];
+    if (!arr.is_object() || !arr.contains("values"))
+      return empty;
+    return arr["values"];
+  }
+
+  static const json& mapFields(const json& v) {
+    static const json empty = json::object();
+    const json& m = v["mapValue"];
+    if (!m.is_object() || !m.contains("fields"))
+      return empty;
+    return m["fields"];
+  }
+
+  template< typename T >
+  static int compareScalars(const T& a, const T& b) {
+    return a < b ? -1 : (b < a ? 1 : 0);
+  }
+
+  static int compareValues(const json& a, const json& b) {
+    int ta = typeOrder(a);
+    int tb = typeOrder(b);
+    if (ta != tb)
+      return ta < tb ? -1 : 1;
+    switch (ta) {
+    case 1:
+      return compareScalars(a["booleanValue"].get<bool>(), b["booleanValue"].get<bool>());
+    case 2:
+      if (isInteger(a) && isInteger(b))
+        return compareScalars(integerOf(a), integerOf(b));
+      return compareScalars(numberOf(a), numberOf(b));
+    case 3:
+      return compareTimestamps(a["timestampValue"], b["timestampValue"]);
+    case 4:
+      return compareScalars(a["stringValue"].get_ref< const std::string& >(), b["stringValue"].get_ref< const std::string& >());
+    case 5:
+      return compareScalars(a["bytesValue"].get_ref< const std::string& >(), b["bytesValue"].get_ref< const std::string& >());
+    case 6:
+      return compareScalars(a["referenceValue"].get_ref< const std::string& >(), b["referenceValue"].get_ref< const std::string& >());
+    case 7: {
+      int c = compareScalars(a["geoPointValue"].value("latitude", 0.0), b["geoPointValue"].value("latitude", 0.0));
+      return c ? c : compareScalars(a["geoPointValue"].value("longitude", 0.0), b["geoPointValue"].value("longitude", 0.0));
+    }
+    case 8: {
+      const json& va = arrayValues(a);
+      const json& vb = arrayValues(b);
+      for (size_t i = 0; i < va.size() && i < vb.size(); ++i) {
+        int c = compareValues(va[i], vb[i]);
+        if (c)
+          return c;
+      }
+      return compareScalars(va.size(), vb.size());
+    }
+    case 9: {
+      // nlohmann objects are sorted by key
+      const json& fa = mapFields(a);
+      const json& fb = mapFields(b);
+      auto ia = fa.begin();
+      auto ib = fb.begin();
+      for (; ia != fa.end() && ib != fb.end(); ++ia, ++ib) {
+        int c = compareScalars(ia.key(), ib.key());
+        if (c)
+          return c;
+        c = compareValues(ia.value(), ib.value());
+        if (c)
+          return c;
+      }
+      return compareScalars(fa.size(), fb.size());
+    }
+    }
+    return 0;
+  }
+
+  static bool arrayContains(const json& values, const json& v) {
+    for (const json& e : values)
+      if (compareValues(e, v) == 0)
+        return true;
+    return false;
+  }
+
+  // -----------------------------------------
+  // Field paths: a.b.c, with segments optionally quoted with backticks: a.`b.c`
+  static std::vector< std::string > splitFieldPath(const std::string& path) {
+    std::vector< std::string > segs;
+    std::string seg;
+    bool quoted = false;
+    for (size_t i = 0; i < path.size(); ++i) {
+      char c = path[i];
+      if (quoted) {
+        if (c == '\\' && i + 1 < path.size())
+          seg.push_back(path[++i]);
+        else if (c == '`')
+          quoted = false;
+        else
+          seg.push_back(c);
+      }
+      else if (c == '`') {
+        quoted = true;
+      }
+      else if (c == '.') {
+        segs.push_back(seg);
+        seg.clear();
+      }
+      else {
+        seg.push_back(c);
+      }
+    }
+    segs.push_back(seg);
+    return segs;
+  }
+
+  static const json* getField(const json& fields, const std::vector< std::string >& segs) {
+    const json* cur = &fields;
+    for (size_t i = 0; i < segs.size(); ++i) {
+      if (!cur->is_object())
+        return nullptr;
+      auto it = cur->find(segs[i]);
+      if (it == cur->end())
+        return nullptr;
+      if (i + 1 == segs.size())
+        return &*it;
+      if (!it->contains("mapValue"))
+        return nullptr;
+      cur = &mapFields(*it);
+    }
+    return nullptr;
+  }
+
+  static void setField(json& fields, const std::vector< std::string >& segs, const json& value) {
+    json* cur = &fields;
+    for (size_t i = 0; i + 1 < segs.size(); ++i) {
+      json& v = (*cur)[segs[i]];
+      if (!v.is_object() || !v.contains("mapValue"))
+        v = { { "mapValue", {{ "fields", json::object() }} } };
+      json& m = v["mapValue"];
+      if (!m.contains("fields"))
+        m["fields"] = json::object();
+      cur = &m["fields"];
+    }
+    (*cur)[segs.back()] = value;
+  }
+
+  static void deleteField(json& fields, const std::vector< std::string >& segs) {
+    json* cur = &fields;
+    for (size_t i = 0; i + 1 < segs.size(); ++i) {
+      auto it = cur->find(segs[i]);
+      if (it == cur->end() || !it->contains("mapValue") || !(*it)["mapValue"].contains("fields"))
+        return;
+      cur = &(*it)["mapValue"]["fields"];
+    }
+    cur->erase(segs.back());
+  }
+
+  // -----------------------------------------
+  struct Emulator::Impl {
+
+    struct Doc {
+      json        fields = json::object();
+      std::string create_time;
+      std::string update_time;
+    };
+
+    struct User {
+      std::string uid;
+      std::string email;
+      std::string password;
+    };
+
+    struct Token {
+      std::string uid;
+      std::chrono::steady_clock::time_point expiration;
+    };
+
+    // Optimistic: the commit is aborted if a doc read by the transaction changed since
+    struct Transaction {
+      std::map< std::string, std::string > reads;             // Doc name -> update time, empty if missing
+    };
+
+    struct Connection {
+      socket_t          s = INVALID_SOCKET;
+      std::thread       thread;
+      std::atomic<bool> done{ false };
+    };
+
+    Config                    cfg;
+    mutable std::mutex        cfg_mutex;
+
+    // The store, users and tokens
+    mutable std::mutex        store_mutex;
+    std::map< std::string, Doc > docs;
+    std::map< std::string, User > users;                     // By email
+    std::unordered_map< std::string, Token > id_tokens;
+    std::unordered_map< std::string, std::string > refresh_tokens;  // To uid
+    std::unordered_map< std::string, Transaction > transactions;
+    std::mt19937              rng;
+    int64_t                   last_timestamp = 0;
+    uint64_t                  next_token_id = 0;
+
+    // Throttling window
+    std::chrono::steady_clock::time_point window_start;
+    int                       window_requests = 0;
+    std::atomic<uint64_t>     num_requests{ 0 };
+
+    // Network
+    socket_t                  listen_socket = INVALID_SOCKET;
+    int                       port = 0;
+    std::atomic<bool>         running{ false };
+    std::thread               accept_thread;
+    std::mutex                connections_mutex;
+    std::vector< std::unique_ptr< Connection > > connections;
+
+    // -----------------------------------------
+    Config config() const {
+      std::lock_guard<std::mutex> lock(cfg_mutex);
+      return cfg;
+    }
+
+    std::string nextTimestamp() {
+      int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+      if (now <= last_timestamp)
+        now = last_timestamp + 1;
+      last_timestamp = now;
+      // Microseconds precision, always increasing
+      return formatTimestamp(Timestamp(now / 1000000, (int32_t)(now % 1000000) * 1000));
+    }
+
+    std::string randomId(int length) {
+      static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+      std::string id;
+      for (int i = 0; i < length; ++i)
+        id.push_back(chars[rng() % (sizeof(chars) - 1)]);
+      return id;
+    }
+
+    static json docToJson(const std::string& name, const Doc& d, const std::vector< std::string >* mask = nullptr) {
+      json j = { {"name", name} };
+      if (mask && !mask->empty()) {
+        json masked = json::object();
+        for (auto& path : *mask) {
+          auto segs = splitFieldPath(path);
+          const json* v = getField(d.fields, segs);
+          if (v)
+            setField(masked, segs, *v);
+        }
+        if (!masked.empty())
+          j["fields"] = masked;
+      }
+      else if (!d.fields.empty()) {
+        j["fields"] = d.fields;
+      }
+      j["createTime"] = d.create_time;
+      j["updateTime"] = d.update_time;
+      return j;
+    }
+
+    // -----------------------------------------
+    // Auth
+    json issueTokens(const User& user, int expires_in) {
+      std::string id_token = "emu-id-" + std::to_string(++next_token_id) + "-" + randomId(16);
+      std::string refresh_token = "emu-refresh-" + randomId(24);
+      id_tokens[id_token] = Token{ user.uid, std::chrono::steady_clock::now() + std::chrono::seconds(expires_in) };
+      refresh_tokens[refresh_token] = user.uid;
+      return {
+        {"localId", user.uid},
+        {"email", user.email},
+        {"idToken", id_token},
+        {"refreshToken", refresh_token},
+        {"expiresIn", std::to_string(expires_in)},
+      };
+    }
+
+    HttpResponse signIn(const json& body, bool sign_up, int expires_in) {
+      std::string email = body.value("email", "");
+      std::string password = body.value("password", "");
+      std::lock_guard<std::mutex> lock(store_mutex);
+      auto it = users.find(email);
+      if (sign_up) {
+        if (email.empty())
+          return errorResponse(400, nullptr, "MISSING_EMAIL");
+        if (it != users.end())
+          return errorResponse(400, nullptr, "EMAIL_EXISTS");
+        User user{ randomId(28), email, password };
+        it = users.emplace(email, user).first;
+      }
+      else {
+        if (it == users.end())
+          return errorResponse(400, nullptr, "EMAIL_NOT_FOUND");
+        if (it->second.password != password)
+          return errorResponse(400, nullptr, "INVALID_PASSWORD");
+      }
+      json j = issueTokens(it->second, expires_in);
+      j["registered"] = !sign_up;
+      return jsonResponse(j);
+    }
+
+    HttpResponse refreshToken(const HttpRequest& req, int expires_in) {
+      // Accepts both the json and the form encoded versions
+      std::string grant_type;
+      std::string refresh_token;
+      json body = json::parse(req.body, nullptr, false);
+      if (body.is_object()) {
+        grant_type = body.value("grantType", body.value("grant_type", ""));
+        refresh_token = body.value("refreshToken", body.value("refresh_token", ""));
+      }
+      else {
+        std::vector< std::pair< std::string, std::string > > form;
+        parseParams(req.body, form);
+        for (auto& kv : form) {
+          if (kv.first == "grant_type") grant_type = kv.second;
+          if (kv.first == "refresh_token") refresh_token = kv.second;
+        }
+      }
+      if (grant_type != "refresh_token")
+        return errorResponse(400, "INVALID_ARGUMENT", "INVALID_GRANT_TYPE");
+      std::lock_guard<std::mutex> lock(store_mutex);
+      auto it = refresh_tokens.find(refresh_token);
+      if (it == refresh_tokens.end())
+        return errorResponse(400, "INVALID_ARGUMENT", "INVALID_REFRESH_TOKEN");
+      User user;
+      for (auto& u : users)
+        if (u.second.uid == it->second)
+          user = u.second;
+      refresh_tokens.erase(it);
+      json j = issueTokens(user, expires_in);
+      return jsonResponse({
+        {"access_token", j["idToken"]},
+        {"expires_in", j["expiresIn"]},
+        {"token_type", "Bearer"},
+        {"refresh_token", j["refreshToken"]},
+        {"id_token", j["idToken"]},
+        {"user_id", user.uid},
+      });
+    }
+
+    bool isAuthorized(const HttpRequest& req) {
+      std::string auth = req.header("authorization");
+      const std::string bearer = "Bearer ";
+      if (!startsWith(auth, bearer))
+        return false;
+      std::lock_guard<std::mutex> lock(store_mutex);
+      auto it = id_tokens.find(auth.substr(bearer.size()));
+      return it != id_tokens.end() && std::chrono::steady_clock::now() < it->second.expiration;
+    }
+
+    // -----------------------------------------
+    // Preconditions from a commit (json) or from the url params
+    HttpResponse checkPrecondition(const std::string& name, const json& precondition) {
+      auto it = docs.find(name);
+      if (precondition.contains("exists")) {
+        bool must_exist = precondition["exists"].is_string() ? precondition["exists"] == "true" : precondition["exists"].get<bool>();
+        if (must_exist && it == docs.end())
+          return errorResponse(404, "NOT_FOUND", "No document to update: " + name);
+        if (!must_exist && it != docs.end())
+          return errorResponse(409, "ALREADY_EXISTS", "Document already exists: " + name);
+      }
+      if (precondition.contains("updateTime")) {
+        if (it == docs.end() || compareTimestamps(it->second.update_time, precondition["updateTime"]) != 0)
+          return errorResponse(400, "FAILED_PRECONDITION", "the stored version does not match the required base version");
+      }
+      return HttpResponse();
+    }
+
+    static json applyTransform(json& fields, const json& t, const std::string& commit_time) {
+      auto segs = splitFieldPath(t.value("fieldPath", ""));
+      const json* cur = getField(fields, segs);
+      bool cur_is_number = cur && typeOrder(*cur) == 2;
+      json new_value;
+      json result = { {"nullValue", nullptr} };
+
+      if (t.contains("increment")) {
+        const json& operand = t["increment"];
+        if (!cur_is_number)
+          new_value = operand;
+        else if (isInteger(*cur) && isInteger(operand))
+          new_value = { {"integerValue", std::to_string(integerOf(*cur) + integerOf(operand))} };
+        else
+          new_value = { {"doubleValue", numberOf(*cur) + numberOf(operand)} };
+        result = new_value;
+      }
+      else if (t.contains("maximum") || t.contains("minimum")) {
+        bool is_max = t.contains("maximum");
+        const json& operand = t[is_max ? "maximum" : "minimum"];
+        if (!cur_is_number)
+          new_value = operand;
+        else {
+          int c = compareValues(operand, *cur);
+          new_value = ((is_max && c > 0) || (!is_max && c < 0)) ? operand : *cur;
+        }
+        result = new_value;
+      }
+      else if (t.contains("setToServerValue")) {
+        new_value = { {"timestampValue", commit_time} };
+        result = new_value;
+      }
+      else if (t.contains("appendMissingElements") || t.contains("removeAllFromArray")) {
+        bool append = t.contains("appendMissingElements");
+        const json& operand = t[append ? "appendMissingElements" : "removeAllFromArray"];
+        json values = (cur && cur->contains("arrayValue")) ? arrayValues(*cur) : json::array();
+        const json& elems = operand.contains("values") ? operand["values"] : json::array();
+        if (append) {
+          for (const json& e : elems)
+            if (!arrayContains(values, e))
+              values.push_back(e);
+        }
+        else {
+          json kept = json::array();
+          for (const json& e : values)
+            if (!arrayContains(elems, e))
+              kept.push_back(e);
+          values = std::move(kept);
+        }
+        new_value = { {"arrayValue", json::object()} };
+        if (!values.empty())
+          new_value["arrayValue"]["values"] = values;
+      }
+      else {
+        return result;
+      }
+      setField(fields, segs, new_value);
+      return result;
+    }
+
+    // Applies the fields of src into the doc, following the mask when given
+    static void applyUpdate(Doc& d, const json& src_fields, const std::vector< std::string >* mask) {
+      if (!mask) {
+        d.fields = src_fields.is_object() ? src_fields : json::object();
+        return;
+      }
+      for (auto& path : *mask) {
+        auto segs = splitFieldPath(path);
+        const json* v = src_fields.is_object() ? getField(src_fields, segs) : nullptr;
+        if (v)
+          setField(d.fields, segs, *v);
+        else
+          deleteField(d.fields, segs);
+      }
+    }
+
+    // -----------------------------------------
+    // Transactions
+    HttpResponse beginTransaction() {
+      std::lock_guard<std::mutex> lock(store_mutex);
+      std::string id = randomId(24);
+      transactions[id] = Transaction();
+      return jsonResponse({ {"transaction", id} });
+    }
+
+    HttpResponse rollback(const json& body) {
+      std::lock_guard<std::mutex> lock(store_mutex);
+      if (transactions.erase(body.value("transaction", "")) == 0)
+        return errorResponse(400, "INVALID_ARGUMENT", "Transaction is invalid or has expired.");
+      return jsonResponse(json::object());
+    }
+
+    static HttpResponse invalidTransaction() {
+      return errorResponse(400, "INVALID_ARGUMENT", "Transaction is invalid or has expired.");
+    }
+
+    // The store mutex must be locked
+    bool transactionIsValid(const Transaction& t) const {
+      for (auto& read : t.reads) {
+        auto it = docs.find(read.first);
+        std::string update_time = it == docs.end() ? std::string() : it->second.update_time;
+        if (update_time != read.second)
+          return false;
+      }
+      return true;
+    }
+
+    // The operands of the array transforms must be ArrayValues, like the server requires
+    static bool validTransforms(const json& transforms) {
+      if (!transforms.is_array())
+        return true;
+      for (const json& t : transforms) {
+        for (const char* op : { "appendMissingElements", "removeAllFromArray" }) {
+          auto it = t.find(op);
+          if (it == t.end())
+            continue;
+          if (!it->is_object() || it->size() > 1 || (it->size() == 1 && !(it->contains("values") && (*it)["values"].is_array())))
+            return false;
+        }
+      }
+      return true;
+    }
+
+    HttpResponse commit(const json& body) {
+      // Repeated fields are also accepted as a single object, as the library sends them
+      json writes = body.contains("writes") ? body["writes"] : json::array();
+      if (writes.is_object())
+        writes = json::array({ writes });
+      std::lock_guard<std::mutex> lock(store_mutex);
+
+      // The transaction ends with the commit, succeeding or not
+      if (body.contains("transaction")) {
+        auto it = transactions.find(body["transaction"].get<std::string>());
+        if (it == transactions.end())
+          return invalidTransaction();
+        bool valid = transactionIsValid(it->second);
+        transactions.erase(it);
+        if (!valid)
+          return errorResponse(409, "ABORTED", "Too much contention on these documents. Please try again.");
+      }
+
+      // Check all the preconditions before changing anything
+      for (const json& w : writes) {
+        std::string name = w.contains("update") ? w["update"].value("name", "")
+          : w.contains("delete") ? w["delete"].get<std::string>()
+          : w.contains("transform") ? w["transform"].value("document", "") : std::string();
+        if (name.empty())
+          return errorResponse(400, "INVALID_ARGUMENT", "Invalid write");
+        if (!validTransforms(w.contains("updateTransforms") ? w["updateTransforms"] : json())
+          || (w.contains("transform") && !validTransforms(w["transform"].value("fieldTransforms", json()))))
+          return errorResponse(400, "INVALID_ARGUMENT", "Invalid value at 'writes.update_transforms', expected an ArrayValue");
+        if (w.contains("currentDocument")) {
+          HttpResponse res = checkPrecondition(name, w["currentDocument"]);
+          if (res.status != 200)
+            return res;
+        }
+      }
+
+      std::string commit_time = nextTimestamp();
+      json write_results = json::array();
+      for (const json& w : writes) {
+        json wr = json::object();
+        if (w.contains("update")) {
+          const json& update = w["update"];
+          std::string name = update["name"];
+          bool existed = docs.count(name) > 0;
+          Doc& d = docs[name];
+          const json empty = json::object();
+          const json& fields = update.contains("fields") ? update["fields"] : empty;
+          if (w.contains("updateMask")) {
+            std::vector< std::string > mask = w["updateMask"].value("fieldPaths", std::vector< std::string >());
+            applyUpdate(d, fields, &mask);
+          }
+          else {
+            applyUpdate(d, fields, nullptr);
+          }
+          if (w.contains("updateTransforms")) {
+            json results = json::array();
+            for (const json& t : w["updateTransforms"])
+              results.push_back(applyTransform(d.fields, t, commit_time));
+            wr["transformResults"] = results;
+          }
+          if (!existed)
+            d.create_time = commit_time;
+          d.update_time = commit_time;
+          wr["updateTime"] = commit_time;
+        }
+        else if (w.contains("delete")) {
+          docs.erase(w["delete"].get<std::string>());
+        }
+        else if (w.contains("transform")) {
+          const json& transform = w["transform"];
+          std::string name = transform["document"];
+          bool existed = docs.count(name) > 0;
+          Doc& d = docs[name];
+          json results = json::array();
+          if (transform.contains("fieldTransforms"))
+            for (const json& t : transform["fieldTransforms"])
+              results.push_back(applyTransform(d.fields, t, commit_time));
+          wr["transformResults"] = results;
+          if (!existed)
+            d.create_time = commit_time;
+          d.update_time = commit_time;
+          wr["updateTime"] = commit_time;
+        }
+        write_results.push_back(wr);
+      }
+      return jsonResponse({ {"writeResults", write_results}, {"commitTime", commit_time} });
+    }
+
+    HttpResponse batchGet(const json& body) {
+      json answer = json::array();
+      std::lock_guard<std::mutex> lock(store_mutex);
+      Transaction* transaction = nullptr;
+      if (body.contains("transaction")) {
+        auto it = transactions.find(body["transaction"].get<std::string>());
+        if (it == transactions.end())
+          return invalidTransaction();
+        transaction = &it->second;
+      }
+      std::string read_time = nextTimestamp();
+      if (body.contains("documents")) {
+        for (const json& jname : body["documents"]) {
+          std::string name = jname;
+          auto it = docs.find(name);
+          if (transaction && !transaction->reads.count(name))
+            transaction->reads[name] = it == docs.end() ? std::string() : it->second.update_time;
+          if (it != docs.end())
+            answer.push_back({ {"found", docToJson(name, it->second)}, {"readTime", read_time} });
+          else
+            answer.push_back({ {"missing", name}, {"readTime", read_time} });
+        }
+      }
+      return jsonResponse(answer);
+    }
+
+    // -----------------------------------------
+    // Queries
+    static const json* docField(const std::string& name, const Doc& d, const std::vector< std::string >& segs, json& scratch) {
+      if (segs.size() == 1 && segs[0] == "__name__") {
+        scratch = { {"referenceValue", name} };
+        return &scratch;
+      }
+      return getField(d.fields, segs);
+    }
+
+    static bool matches(const std::string& name, const Doc& d, const json& filter) {
+      if (filter.is_null())
+        return true;
+
+      if (filter.contains("compositeFilter")) {
+        const json& cf = filter["compositeFilter"];
+        bool is_or = cf.value("op", "AND") == "OR";
+        if (!cf.contains("filters"))
+          return true;
+        for (const json& f : cf["filters"]) {
+          bool m = matches(name, d, f);
+          if (is_or && m)
+            return true;
+          if (!is_or && !m)
+            return false;
+        }
+        return !is_or;
+      }
+
+      json scratch;
+      if (filter.contains("unaryFilter")) {
+        const json& uf = filter["unaryFilter"];
+        std::string op = uf.value("op", "");
+        const json* v = docField(name, d, splitFieldPath(uf["field"].value("fieldPath", "")), scratch);
+        bool is_null = v && typeOrder(*v) == 0;
+        bool is_nan = v && v->contains("doubleValue") && numberOf(*v) != numberOf(*v);
+        if (op == "IS_NULL") return is_null;
+        if (op == "IS_NOT_NULL") return v && !is_null;
+        if (op == "IS_NAN") return is_nan;
+        if (op == "IS_NOT_NAN") return v && typeOrder(*v) == 2 && !is_nan;
+        return false;
+      }
+
+      if (filter.contains("fieldFilter")) {
+        const json& ff = filter["fieldFilter"];
+        std::string op = ff.value("op", "");
+        const json& ref = ff["value"];
+        const json* v = docField(name, d, splitFieldPath(ff["field"].value("fieldPath", "")), scratch);
+        if (!v)
+          return false;
+        bool same_type = typeOrder(*v) == typeOrder(ref);
+        if (op == "EQUAL") return same_type && compareValues(*v, ref) == 0;
+        if (op == "NOT_EQUAL") return typeOrder(*v) != 0 && compareValues(*v, ref) != 0;
+        if (op == "LESS_THAN") return same_type && compareValues(*v, ref) < 0;
+        if (op == "LESS_THAN_OR_EQUAL") return same_type && compareValues(*v, ref) <= 0;
+        if (op == "GREATER_THAN") return same_type && compareValues(*v, ref) > 0;
+        if (op == "GREATER_THAN_OR_EQUAL") return same_type && compareValues(*v, ref) >= 0;
+        if (op == "ARRAY_CONTAINS") return v->contains("arrayValue") && arrayContains(arrayValues(*v), ref);
+        if (op == "IN") return arrayContains(arrayValues(ref), *v);
+        if (op == "NOT_IN") return typeOrder(*v) != 0 && !arrayContains(arrayValues(ref), *v);
+        if (op == "ARRAY_CONTAINS_ANY") {
+          if (!v->contains("arrayValue"))
+            return false;
+          for (const json& e : arrayValues(ref))
+            if (arrayContains(arrayValues(*v), e))
+              return true;
+          return false;
+        }
+      }
+      return false;
+    }
+
+    HttpResponse runQuery(const std::string& parent, const json& body) {
+      if (!body.contains("structuredQuery"))
+        return errorResponse(400, "INVALID_ARGUMENT", "Only structured queries are supported");
+      const json& sq = body["structuredQuery"];
+
+      // 'from' is a repeated field, but the library sends a single object
+      json from = sq.contains("from") ? sq["from"] : json::object();
+      if (from.is_array())
+        from = from.empty() ? json::object() : from[0];
+      std::string collection_id = from.value("collectionId", "");
+      bool all_descendants = from.value("allDescendants", false);
+
+      struct OrderBy {
+        std::vector< std::string > segs;
+        bool descending;
+      };
+      std::vector< OrderBy > order_by;
+      if (sq.contains("orderBy")) {
+        for (const json& o : sq["orderBy"])
+          order_by.push_back({ splitFieldPath(o["field"].value("fieldPath", "")), o.value("direction", "ASCENDING") == "DESCENDING" });
+      }
+
+      int limit = -1;
+      if (sq.contains("limit"))
+        limit = sq["limit"].is_object() ? sq["limit"].value("value", -1) : sq["limit"].get<int>();
+      int offset = sq.value("offset", 0);
+
+      std::vector< std::string > select;
+      if (sq.contains("select") && sq["select"].contains("fields"))
+        for (const json& f : sq["select"]["fields"])
+          select.push_back(f.value("fieldPath", ""));
+
+      std::lock_guard<std::mutex> lock(store_mutex);
+      std::string read_time = nextTimestamp();
+
+      struct Candidate {
+        const std::string* name;
+        const Doc* doc;
+      };
+      std::vector< Candidate > found;
+      std::string prefix = parent + "/";
+      for (auto it = docs.lower_bound(prefix); it != docs.end() && startsWith(it->first, prefix); ++it) {
+        std::string rel = it->first.substr(prefix.size());
+        // The doc must be in a collection named collection_id
+        size_t last_slash = rel.rfind('/');
+        if (last_slash == std::string::npos)
+          continue;
+        std::string coll_path = rel.substr(0, last_slash);
+        size_t coll_slash = coll_path.rfind('/');
+        std::string coll_name = coll_slash == std::string::npos ? coll_path : coll_path.substr(coll_slash + 1);
+        if (coll_name != collection_id)
+          continue;
+        if (!all_descendants && coll_slash != std::string::npos)
+          continue;
+        if (sq.contains("where") && !matches(it->first, it->second, sq["where"]))
+          continue;
+        // Docs without the order by fields are not returned
+        bool has_fields = true;
+        json scratch;
+        for (auto& o : order_by)
+          has_fields = has_fields && docField(it->first, it->second, o.segs, scratch) != nullptr;
+        if (!has_fields)
+          continue;
+        found.push_back({ &it->first, &it->second });
+      }
+
+      std::stable_sort(found.begin(), found.end(), [&](const Candidate& a, const Candidate& b) {
+        json sa, sb;
+        for (auto& o : order_by) {
+          int c = compareValues(*docField(*a.name, *a.doc, o.segs, sa), *docField(*b.name, *b.doc, o.segs, sb));
+          if (c)
+            return o.descending ? c > 0 : c < 0;
+        }
+        bool last_desc = !order_by.empty() && order_by.back().descending;
+        return last_desc ? *b.name < *a.name : *a.name < *b.name;
+      });
+
+      json answer = json::array();
+      for (size_t i = (size_t)std::max(offset, 0); i < found.size(); ++i) {
+        if (limit >= 0 && (int)answer.size() >= limit)
+          break;
+        answer.push_back({ {"document", docToJson(*found[i].name, *found[i].doc, &select)}, {"readTime", read_time} });
+      }
+      if (answer.empty())
+        answer.push_back({ {"readTime", read_time} });
+      return jsonResponse(answer);
+    }
+
+    // -----------------------------------------
+    // Requests on a single document or collection
+    HttpResponse listDocuments(const std::string& collection, const HttpRequest& req) {
+      int page_size = atoi(req.param("pageSize").c_str());
+      if (page_size <= 0)
+        page_size = EmulatorCtes::default_page_size;
+      std::string page_token = req.param("pageToken");
+      std::string prefix = collection + "/";
+
+      std::lock_guard<std::mutex> lock(store_mutex);
+      json jdocs = json::array();
+      std::string next_token;
+      auto it = page_token.empty() ? docs.lower_bound(prefix) : docs.upper_bound(prefix + page_token);
+      for (; it != docs.end() && startsWith(it->first, prefix); ++it) {
+        std::string id = it->first.substr(prefix.size());
+        if (id.find('/') != std::string::npos)
+          continue;
+        if ((int)jdocs.size() == page_size) {
+          next_token = jdocs.back()["name"].get<std::string>().substr(prefix.size());
+          break;
+        }
+        jdocs.push_back(docToJson(it->first, it->second));
+      }
+      json answer = json::object();
+      if (!jdocs.empty())
+        answer["documents"] = jdocs;
+      if (!next_token.empty())
+        answer["nextPageToken"] = next_token;
+      return jsonResponse(answer);
+    }
+
+    static json preconditionFromParams(const HttpRequest& req) {
+      json precondition = json::object();
+      std::string exists = req.param("currentDocument.exists");
+      if (!exists.empty())
+        precondition["exists"] = exists == "true";
+      std::string update_time = req.param("currentDocument.updateTime");
+      if (!update_time.empty())
+        precondition["updateTime"] = update_time;
+      return precondition;
+    }
+
+    HttpResponse getDocument(const std::string& name) {
+      std::lock_guard<std::mutex> lock(store_mutex);
+      auto it = docs.find(name);
+      if (it == docs.end())
+        return errorResponse(404, "NOT_FOUND", "Document \"" + name + "\" not found.");
+      return jsonResponse(docToJson(name, it->second));
+    }
+
+    HttpResponse createDocument(const std::string& collection, const HttpRequest& req, const json& body) {
+      std::lock_guard<std::mutex> lock(store_mutex);
+      std::string id = req.param("documentId");
+      if (id.empty())
+        id = randomId(20);
+      std::string name = collection + "/" + id;
+      if (docs.count(name))
+        return errorResponse(409, "ALREADY_EXISTS", "Document already exists: " + name);
+      Doc& d = docs[name];
+      applyUpdate(d, body.contains("fields") ? body["fields"] : json::object(), nullptr);
+      d.create_time = d.update_time = nextTimestamp();
+      return jsonResponse(docToJson(name, d));
+    }
+
+    HttpResponse patchDocument(const std::string& name, const HttpRequest& req, const json& body) {
+      std::vector< std::string > update_mask = req.params_named("updateMask.fieldPaths");
+      std::vector< std::string > mask = req.params_named("mask.fieldPaths");
+      std::lock_guard<std::mutex> lock(store_mutex);
+      HttpResponse res = checkPrecondition(name, preconditionFromParams(req));
+      if (res.status != 200)
+        return res;
+      bool existed = docs.count(name) > 0;
+      Doc& d = docs[name];
+      const json& fields = body.contains("fields") ? body["fields"] : json::object();
+      applyUpdate(d, fields, update_mask.empty() ? nullptr : &update_mask);
+      d.update_time = nextTimestamp();
+      if (!existed)
+        d.create_time = d.update_time;
+      return jsonResponse(docToJson(name, d, &mask));
+    }
+
+    HttpResponse deleteDocument(const std::string& name, const HttpRequest& req) {
+      std::lock_guard<std::mutex> lock(store_mutex);
+      HttpResponse res = checkPrecondition(name, preconditionFromParams(req));
+      if (res.status != 200)
+        return res;
+      docs.erase(name);
+      return jsonResponse(json::object());
+    }
+
+    // -----------------------------------------
+    HttpResponse handleFirestore(const HttpRequest& req, const json& body) {
+      // /v1/projects/{project}/databases/{db}/documents{rest}
+      size_t doc_pos = req.path.find(EmulatorCtes::documents_key);
+      if (doc_pos == std::string::npos)
+        return errorResponse(404, "NOT_FOUND", "Unknown path " + req.path);
+      std::string root = req.path.substr(strlen(EmulatorCtes::firestore_prefix), doc_pos + strlen(EmulatorCtes::documents_key) - strlen(EmulatorCtes::firestore_prefix));
+      std::string rest = req.path.substr(doc_pos + strlen(EmulatorCtes::documents_key));
+
+      // Custom methods, like :commit or users/abc:runQuery
+      size_t colon = rest.rfind(':');
+      if (colon != std::string::npos) {
+        std::string method = rest.substr(colon + 1);
+        std::string parent = root + rest.substr(0, colon);
+        if (req.method != "POST")
+          return errorResponse(400, "INVALID_ARGUMENT", "Expected POST");
+        if (method == "commit")
+          return commit(body);
+        if (method == "batchGet")
+          return batchGet(body);
+        if (method == "runQuery")
+          return runQuery(parent, body);
+        if (method == "beginTransaction")
+          return beginTransaction();
+        if (method == "rollback")
+          return rollback(body);
+        return errorResponse(404, "NOT_FOUND", "Unknown method " + method);
+      }
+
+      if (rest.size() <= 1)
+        return errorResponse(400, "INVALID_ARGUMENT", "Missing document path");
+      std::string rel = rest.substr(1);
+      while (!rel.empty() && rel.back() == '/')
+        rel.pop_back();
+      std::string name = root + "/" + rel;
+      bool is_collection = (countSegments(rel) & 1) == 1;
+
+      if (req.method == "GET")
+        return is_collection ? listDocuments(name, req) : getDocument(name);
+      if (req.method == "POST" && is_collection)
+        return createDocument(name, req, body);
+      if (req.method == "PATCH" && !is_collection)
+        return patchDocument(name, req, body);
+      if (req.method == "DELETE" && !is_collection)
+        return deleteDocument(name, req);
+      return errorResponse(400, "INVALID_ARGUMENT", req.method + " not supported on " + rel);
+    }
+
+    // Returns true if the request exceeds the max rate
+    bool throttle(int max_requests_per_sec) {
+      if (max_requests_per_sec <= 0)
+        return false;
+      std::lock_guard<std::mutex> lock(store_mutex);
+      auto now = std::chrono::steady_clock::now();
+      if (now - window_start >= std::chrono::seconds(1)) {
+        window_start = now;
+        window_requests = 0;
+      }
+      return ++window_requests > max_requests_per_sec;
+    }
+
+    bool randomFailure(float error_rate) {
+      if (error_rate <= 0.0f)
+        return false;
+      std::lock_guard<std::mutex> lock(store_mutex);
+      return std::uniform_real_distribution<float>(0.0f, 1.0f)(rng) < error_rate;
+    }
+
+    int randomJitter(int jitter_ms) {
+      if (jitter_ms <= 0)
+        return 0;
+      std::lock_guard<std::mutex> lock(store_mutex);
+      return (int)(rng() % (uint32_t)(jitter_ms + 1));
+    }
+
+    HttpResponse handle(const HttpRequest& req) {
+      ++num_requests;
+      Config c = config();
+
+      HttpResponse res;
+      std::string body_str = req.body;
+      json body = body_str.empty() ? json::object() : json::parse(body_str, nullptr, false);
+
+      if (throttle(c.max_requests_per_sec)) {
+        res = errorResponse(429, "RESOURCE_EXHAUSTED", "Quota exceeded.");
+        res.retry_after_secs = 1;
+      }
+      else if (randomFailure(c.error_rate))
+        res = errorResponse(503, "UNAVAILABLE", "The service is currently unavailable.");
+      else if (req.path == EmulatorCtes::refresh_token_path)
+        res = refreshToken(req, c.token_expires_in_secs);
+      else if (body.is_discarded())
+        res = errorResponse(400, "INVALID_ARGUMENT", "Invalid JSON payload received.");
+      else if (req.path == EmulatorCtes::sign_in_path)
+        res = signIn(body, false, c.token_expires_in_secs);
+      else if (req.path == EmulatorCtes::sign_up_path)
+        res = signIn(body, true, c.token_expires_in_secs);
+      else if (!startsWith(req.path, EmulatorCtes::firestore_prefix))
+        res = errorResponse(404, "NOT_FOUND", "Unknown path " + req.path);
+      else if (c.check_tokens && !isAuthorized(req))
+        res = errorResponse(401, "UNAUTHENTICATED", "Request had invalid authentication credentials.");
+      else
+        res = handleFirestore(req, body);
+
+      int delay_ms = c.latency_ms + randomJitter(c.latency_jitter_ms);
+      if (delay_ms > 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+      return res;
+    }
+
+    // -----------------------------------------
+    // Http
+    static bool sendAll(socket_t s, const char* data, size_t size) {
+      while (size > 0) {
+        int n = (int)send(s, data, (int)size, SEND_FLAGS);
+        if (n <= 0)
+          return false;
+        data += n;
+        size -= n;
+      }
+      return true;
+    }
+
+    static bool inflateGzip(const std::string& input, std::string& output) {
+#ifdef MINI_FIRESTORE_ZLIB
+      z_stream zs = {};
+      if (inflateInit2(&zs, 15 + 16) != Z_OK)
+        return false;
+      zs.next_in = (Bytef*)input.data();
+      zs.avail_in = (uInt)input.size();
+      char buf[16384];
+      int rc = Z_OK;
+      output.clear();
+      while (rc == Z_OK) {
+        zs.next_out = (Bytef*)buf;
+        zs.avail_out = sizeof(buf);
+        rc = inflate(&zs, Z_NO_FLUSH);
+        output.append(buf, sizeof(buf) - zs.avail_out);
+      }
+      inflateEnd(&zs);
+      return rc == Z_STREAM_END;
+#else
+      (void)input;
+      (void)output;
+      return false;
+#endif
+    }
+
+    void serveConnection(Connection* conn) {
+      socket_t s = conn->s;
+      std::string buf;
+      char tmp[16384];
+      bool keep_alive = true;
+
+      auto recvMore = [&]() {
+        int n = (int)recv(s, tmp, sizeof(tmp), 0);
+        if (n <= 0)
+          return false;
+        buf.append(tmp, n);
+        return true;
+      };
+
+      while (keep_alive && running) {
+        size_t header_end;
+        while ((header_end = buf.find("\r\n\r\n")) == std::string::npos)
+          if (!recvMore())
+            goto done;
+
+        {
+          HttpRequest req;
+          std::string head = buf.substr(0, header_end);
+          size_t line_end = head.find("\r\n");
+          std::string request_line = head.substr(0, line_end);
+          size_t sp1 = request_line.find(' ');
+          size_t sp2 = request_line.rfind(' ');
+          if (sp1 == std::string::npos || sp2 == sp1)
+            break;
+          req.method = request_line.substr(0, sp1);
+          std::string target = request_line.substr(sp1 + 1, sp2 - sp1 - 1);
+          size_t q = target.find('?');
+          req.path = urlDecode(target.substr(0, q));
+          if (q != std::string::npos)
+            parseParams(target.substr(q + 1), req.params);
+
+          size_t pos = line_end == std::string::npos ? head.size() : line_end + 2;
+          while (pos < head.size()) {
+            size_t eol = head.find("\r\n", pos);
+            if (eol == std::string::npos)
+              eol = head.size();
+            std::string line = head.substr(pos, eol - pos);
+            size_t colon = line.find(':');
+            if (colon != std::string::npos) {
+              std::string key = line.substr(0, colon);
+              for (auto& ch : key)
+                ch = (char)tolower((unsigned char)ch);
+              size_t vstart = line.find_first_not_of(' ', colon + 1);
+              req.headers[key] = vstart == std::string::npos ? std::string() : line.substr(vstart);
+            }
+            pos = eol + 2;
+          }
+
+          if (!req.header("transfer-encoding").empty()) {
+            std::string answer = "HTTP/1.1 411 Length Required\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            sendAll(s, answer.data(), answer.size());
+            break;
+          }
+
+          size_t content_length = (size_t)strtoull(req.header("content-length").c_str(), nullptr, 10);
+          size_t body_start = header_end + 4;
+          if (req.header("expect") == "100-continue" && buf.size() < body_start + content_length) {
+            const char* cont = "HTTP/1.1 100 Continue\r\n\r\n";
+            sendAll(s, cont, strlen(cont));
+          }
+          while (buf.size() < body_start + content_length)
+            if (!recvMore())
+              goto done;
+          req.body = buf.substr(body_start, content_length);
+          buf.erase(0, body_start + content_length);
+
+          HttpResponse res;
+          if (req.header("content-encoding") == "gzip") {
+            std::string plain;
+            if (inflateGzip(req.body, plain))
+              req.body.swap(plain);
+            else
+              res = errorResponse(400, "INVALID_ARGUMENT", "Unable to decompress the body");
+          }
+          if (res.status == 200)
+            res = handle(req);
+
+          keep_alive = req.header("connection") != "close";
+
+          const char* content_encoding = "";
+          std::string gz;
+          if (req.header("accept-encoding").find("gzip") != std::string::npos && res.body.size() >= EmulatorCtes::min_gzip_answer_size && gzipCompress(res.body, gz)) {
+            res.body.swap(gz);
+            content_encoding = "Content-Encoding: gzip\r\n";
+          }
+
+          char retry_after[64] = "";
+          if (res.retry_after_secs > 0)
+            snprintf(retry_after, sizeof(retry_after), "Retry-After: %d\r\n", res.retry_after_secs);
+
+          char header[512];
+          snprintf(header, sizeof(header), "HTTP/1.1 %d %s\r\nContent-Type: application/json; charset=UTF-8\r\n%s%sContent-Length: %d\r\n%s\r\n",
+            res.status, statusText(res.status), content_encoding, retry_after, (int)res.body.size(), keep_alive ? "" : "Connection: close\r\n");
+          std::string answer = header;
+          answer.append(res.body);
+          if (!sendAll(s, answer.data(), answer.size()))
+            break;
+        }
+      }
+
+    done:
+      // Only the reaper closes the socket, after the join, so it can't shutdown a reused descriptor
+      shutdown(s, 2);
+      conn->done = true;
+    }
+
+    void reapConnections(bool all) {
+      std::lock_guard<std::mutex> lock(connections_mutex);
+      for (size_t i = 0; i < connections.size(); ) {
+        Connection* c = connections[i].get();
+        if (all && !c->done)
+          shutdown(c->s, 2);
+        if (all || c->done) {
+          c->thread.join();
+          closesocket(c->s);
+          connections.erase(connections.begin() + i);
+        }
+        else {
+          ++i;
+        }
+      }
+    }
+
+    void acceptLoop() {
+      while (running) {
+        fd_set set;
+        FD_ZERO(&set);
+        FD_SET(listen_socket, &set);
+        timeval tv = { 0, 100 * 1000 };
+        int rc = select((int)listen_socket + 1, &set, nullptr, nullptr, &tv);
+        if (rc <= 0)
+          continue;
+        socket_t s = accept(listen_socket, nullptr, nullptr);
+        if (s == INVALID_SOCKET)
+          continue;
+        int one = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+        setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, (const char*)&one, sizeof(one));
+#endif
+        reapConnections(false);
+        std::unique_ptr< Connection > conn(new Connection());
+        conn->s = s;
+        Connection* c = conn.get();
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        connections.push_back(std::move(conn));
+        c->thread = std::thread(&Impl::serveConnection, this, c);
+      }
+    }
+
+    bool start(const Config& new_config) {
+#ifdef _WIN32
+      WSADATA wsa_data;
+      WSAStartup(MAKEWORD(2, 2), &wsa_data);
+#endif
+      cfg = new_config;
+      rng.seed(cfg.random_seed);
+      window_start = std::chrono::steady_clock::now();
+
+      listen_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+      if (listen_socket == INVALID_SOCKET)
+        return false;
+      int one = 1;
+      setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, (const char*)&one, sizeof(one));
+
+      sockaddr_in addr = {};
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      addr.sin_port = htons((uint16_t)cfg.port);
+      if (bind(listen_socket, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listen_socket, 128) != 0) {
+        closesocket(listen_socket);
+        listen_socket = INVALID_SOCKET;
+        return false;
+      }
+
+      socklen_t len = sizeof(addr);
+      getsockname(listen_socket, (sockaddr*)&addr, &len);
+      port = ntohs(addr.sin_port);
+
+      running = true;
+      accept_thread = std::thread(&Impl::acceptLoop, this);
+      return true;
+    }
+
+    void stop() {
+      if (!running)
+        return;
+      running = false;
+      accept_thread.join();
+      closesocket(listen_socket);
+      listen_socket = INVALID_SOCKET;
+      reapConnections(true);
+#ifdef _WIN32
+      WSACleanup();
+#endif
+    }
+  };
+
+  // -----------------------------------------
+  Emulator::Emulator() : impl(new Impl()) {
+  }
+
+  Emulator::~Emulator() {
+    stop();
+    delete impl;
+  }
+
+  bool Emulator::start() {
+    return start(Config());
+  }
+
+  bool Emulator::start(const Config& config) {
+    if (impl->running)
+      return false;
+    return impl->start(config);
+  }
+
+  void Emulator::stop() {
+    impl->stop();
+  }
+
+  bool Emulator::isRunning() const {
+    return impl->running;
+  }
+
+  void Emulator::setConfig(const Config& new_config) {
+    std::lock_guard<std::mutex> lock(impl->cfg_mutex);
+    int port = impl->cfg.port;
+    impl->cfg = new_config;
+    impl->cfg.port = port;
+  }
+
+  Emulator::Config Emulator::config() const {
+    return impl->config();
+  }
+
+  int Emulator::port() const {
+    return impl->port;
+  }
+
+  std::string Emulator::host() const {
+    return "127.0.0.1:" + std::to_string(impl->port);
+  }
+
+  void Emulator::clear() {
+    std::lock_guard<std::mutex> lock(impl->store_mutex);
+    impl->docs.clear();
+  }
+
+  size_t Emulator::numDocuments() const {
+    std::lock_guard<std::mutex> lock(impl->store_mutex);
+    return impl->docs.size();
+  }
+
+  void Emulator::expireTokens() {
+    std::lock_guard<std::mutex> lock(impl->store_mutex);
+    impl->id_tokens.clear();
+  }
+
+  uint64_t Emulator::numRequests() const {
+    return impl->num_requests;
+  }
+
+}
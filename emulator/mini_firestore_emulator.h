@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+namespace MiniFireStore
+{
+
+  // Local stand-in of the firestore and auth REST services, running in a background thread.
+  // It implements the subset of the api used by the library over an in-memory store, so tests
+  // and benchmarks can run without credentials or network. Use it with Firestore::useEmulator:
+  //
+  //    Emulator emulator;
+  //    emulator.start();
+  //    db.useEmulator(emulator.host());
+  //    db.configure("demo-project", "any-api-key");
+  //
+  class Emulator {
+  public:
+
+    struct Config {
+      int      port = 0;                    // 0 to let the system choose a free port
+      int      latency_ms = 0;              // Added to every answer
+      int      latency_jitter_ms = 0;       // Random extra latency in the range [0..jitter]
+      float    error_rate = 0.0f;           // Probability to answer with 503 UNAVAILABLE
+      int      max_requests_per_sec = 0;    // Above this rate, answers 429 RESOURCE_EXHAUSTED. 0 for no limit
+      int      token_expires_in_secs = 3600;
+      bool     check_tokens = true;         // Reject firestore requests without a valid id token
+      uint32_t random_seed = 1234;
+    };
+
+    Emulator();
+    Emulator(const Emulator&) = delete;
+    ~Emulator();
+
+    bool start();
+    bool start(const Config& config);
+    void stop();
+    bool isRunning() const;
+
+    // Can be changed while running. The port is ignored.
+    void setConfig(const Config& new_config);
+    Config config() const;
+
+    int port() const;
+    std::string host() const;               // 127.0.0.1:port
+
+    // Removes all the documents. Users are kept
+    void clear();
+    size_t numDocuments() const;
+
+    // All the id tokens issued so far are rejected from now on
+    void expireTokens();
+
+    uint64_t numRequests() const;
+
+  private:
+    struct Impl;
+    Impl* impl = nullptr;
+  };
+
+}
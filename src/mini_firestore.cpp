@@ -1,26 +1,23 @@
 #include <cstdio>
 #include <cstdarg>
+#include <cstring>
 #include <ctime>
+#include <cmath>
+#include <memory>
+#include <atomic>
+#include <algorithm>
 #include "mini_firestore.h"
 
 extern "C" {
 #include <curl/curl.h>
+#ifdef MINI_FIRESTORE_ZLIB
+#include <zlib.h>
+#endif
 }
 
 // Windows specifics
 #ifdef _WIN32
-
 #undef min
-#define vsnprintf _vsnprintf_s
-#define sscanf sscanf_s
-struct tm* gmtime_r(const time_t* timer, struct tm* user_tm) {
-  gmtime_s(user_tm, timer);
-  return user_tm;
-}
-struct tm* localtime_r(const time_t* timer, struct tm* user_tm) {
-  localtime_s(user_tm, timer);
-  return user_tm;
-}
 #endif
 
 namespace MiniFireStore
@@ -28,10 +25,25 @@ namespace MiniFireStore
   namespace Ctes {
     const char* api_verify_password_host = "https://identitytoolkit.googleapis.com/v1/accounts:signInWithPassword";
     const char* api_signup_host = "https://identitytoolkit.googleapis.com/v1/accounts:signUp";
+    const char* api_refresh_token_host = "https://securetoken.googleapis.com/v1/token";
     const char* api_firestore_url = "https://firestore.googleapis.com/v1/projects/";
+    const char* emulator_firestore_path = "/v1/projects/";
     const char* auth_bearer = "Authorization: Bearer ";         // <-- Has already a space in the right
     const char* json_content_header = "Content-Type: application/json";
+    const char* gzip_encoding_header = "Content-Encoding: gzip";
     const std::string json_doc_id_key = "_doc_id";
+    const int token_refresh_margin_secs = 300;                 // Refresh the token 5 minutes before it expires, or at half its life
+    const int token_refresh_retry_secs = 30;                   // Wait before retrying a failed refresh
+    const size_t max_pooled_buffer_capacity = 256 * 1024;      // Larger buffers are released when the request returns to the pool
+    const size_t max_content_length_reserve = 64 * 1024 * 1024;
+    const long long compressed_answer_ratio = 8;               // Expected decoded size of the gzip/br answers per byte received
+    const double rate_limit_burst_secs = 0.1;                  // Tokens accumulated by an idle bucket
+    const int rate_decrease_cooldown_ms = 250;                 // A burst of errors only cuts the rate once
+    const double slow_answer_decrease_factor = 0.9;
+    const int deferred_poll_ms = 5;                            // Max wait() while requests are deferred
+    const int transaction_backoff_ms = 100;                    // Doubles on each retry of an aborted transaction
+    const int transaction_max_backoff_ms = 5000;
+    const long default_max_connects = 16;                      // Idle connections kept besides the prewarmed ones
     //const char* client_header = "x-firebase-client";
   }
 
@@ -40,6 +52,11 @@ namespace MiniFireStore
   static const int RPC_FLAG_CONNECT = 4;
   static const int RPC_FLAG_GET = 8;
   static const int RPC_FLAG_PATCH = 16;
+  static const int RPC_FLAG_REPLAYED = 32;     // Already resent once after an UNAUTHENTICATED answer
+  static const int RPC_FLAG_GZIP_BODY = 64;    // Body is sent gzip compressed
+  static const int RPC_FLAG_ACCEPT_ENCODING = 128;
+  static const int RPC_FLAG_WRITE = 256;       // Limited by the write rate instead of the read rate
+  static const int RPC_FLAG_PREWARM = 512;     // Only opens a connection. Any answer of the server is fine
 
   const char* conditionOperatorName(Condition::Operator op) {
     switch (op) {
@@ -58,34 +75,374 @@ namespace MiniFireStore
     return "EQUAL";
   }
 
+  // -----------------------------------------
+  // Canonical status codes of the google apis, as reported in the error bodies
+  static const char* grpc_status_names[] = {
+    "OK", "CANCELLED", "UNKNOWN", "INVALID_ARGUMENT", "DEADLINE_EXCEEDED", "NOT_FOUND", "ALREADY_EXISTS",
+    "PERMISSION_DENIED", "RESOURCE_EXHAUSTED", "FAILED_PRECONDITION", "ABORTED", "OUT_OF_RANGE",
+    "UNIMPLEMENTED", "INTERNAL", "UNAVAILABLE", "DATA_LOSS", "UNAUTHENTICATED",
+  };
+
+  // Used when the body does not tell the status
+  static const char* grpcStatusOfHttp(long http_status) {
+    switch (http_status) {
+    case 400: return "INVALID_ARGUMENT";
+    case 401: return "UNAUTHENTICATED";
+    case 403: return "PERMISSION_DENIED";
+    case 404: return "NOT_FOUND";
+    case 409: return "ABORTED";
+    case 412: return "FAILED_PRECONDITION";
+    case 429: return "RESOURCE_EXHAUSTED";
+    case 499: return "CANCELLED";
+    case 500: return "INTERNAL";
+    case 501: return "UNIMPLEMENTED";
+    case 503: return "UNAVAILABLE";
+    case 504: return "DEADLINE_EXCEEDED";
+    }
+    return "UNKNOWN";
+  }
+
+  // Finds the "status" : "NAME" of an error body without parsing it to json
+  static const char* grpcStatusOfErrorBody(const std::string& body) {
+    size_t pos = body.find("\"status\"");
+    if (pos == std::string::npos)
+      return nullptr;
+    pos = body.find('"', body.find(':', pos));
+    if (pos == std::string::npos)
+      return nullptr;
+    size_t end = body.find('"', pos + 1);
+    if (end == std::string::npos)
+      return nullptr;
+    const char* name = body.data() + pos + 1;
+    size_t len = end - pos - 1;
+    for (const char* status : grpc_status_names) {
+      if (strlen(status) == len && memcmp(status, name, len) == 0)
+        return status;
+    }
+    return nullptr;
+  }
+
   // -----------------------------------------
   static LogCallback current_callback;
   static eLevel      current_level = eLevel::Error;
+  static int         enabled_level = -1;          // current_level, or -1 when there is no callback
   static bool        check_certificates = false;
   static bool        full_curl_traces = false;
 
   void setLogCallback(LogCallback new_callback) {
     current_callback = new_callback;
+    enabled_level = current_callback ? (int)current_level : -1;
   }
 
   void setLogLevel(eLevel new_level) {
     current_level = new_level;
+    enabled_level = current_callback ? (int)current_level : -1;
   }
 
-  void log(eLevel level, const char* fmt, ...) {
-    if (!current_callback || level > current_level)
-      return;
-    char buf[8192];
-    va_list ap;
+  static inline bool isLogEnabled(eLevel level) {
+    return (int)level <= enabled_level;
+  }
+
+  // Messages longer than the stack buffer are formatted again in the heap, never truncated
+  static void logFormat(eLevel level, const char* fmt, ...) {
+    char buf[1024];
+    va_list ap, ap_retry;
     va_start(ap, fmt);
-    int n = vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
-    if (n < 0)
-      buf[sizeof(buf) - 1] = 0x00;
+    va_copy(ap_retry, ap);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
     va_end(ap);
+    if (n < 0) {
+      buf[0] = 0x00;
+    }
+    else if ((size_t)n >= sizeof(buf)) {
+      std::string big((size_t)n + 1, '\0');
+      vsnprintf(&big[0], big.size(), fmt, ap_retry);
+      va_end(ap_retry);
+      current_callback(level, big.c_str());
+      return;
+    }
+    va_end(ap_retry);
     current_callback(level, buf);
   }
 
+  // Large payloads go to the callback as they are, without formatting nor copies
+  static void logPayload(eLevel level, const std::string& payload) {
+    current_callback(level, payload.c_str());
+  }
+
+  // The arguments are only evaluated when the level is enabled, so a disabled level costs one branch.
+  // Levels above MINI_FIRESTORE_MAX_LOG_LEVEL are removed at compile time
+#ifndef MINI_FIRESTORE_MAX_LOG_LEVEL
+#define MINI_FIRESTORE_MAX_LOG_LEVEL 2
+#endif
+#define LOG(level, ...) \
+  do { if ((int)(level) <= MINI_FIRESTORE_MAX_LOG_LEVEL && isLogEnabled(level)) logFormat(level, __VA_ARGS__); } while (0)
+#define LOG_PAYLOAD(level, payload) \
+  do { if ((int)(level) <= MINI_FIRESTORE_MAX_LOG_LEVEL && isLogEnabled(level)) logPayload(level, payload); } while (0)
+
+  // -----------------------------------------
+  // Immutable list of http headers. Each request holds a reference while it's on the fly,
+  // so the list can be replaced at any time without affecting the requests already sent.
+  struct HeaderSet {
+    curl_slist* chunk = nullptr;
+    HeaderSet(std::initializer_list< std::string > lines) {
+      for (auto& line : lines)
+        chunk = curl_slist_append(chunk, line.c_str());
+    }
+    HeaderSet(const HeaderSet&) = delete;
+    ~HeaderSet() {
+      curl_slist_free_all(chunk);
+    }
+  };
+  using HeaderSetPtr = std::shared_ptr< const HeaderSet >;
+
+  // -----------------------------------------
+  int Stats::Histogram::bucketOf(uint64_t us) {
+    if (us < 8)
+      return (int)us;
+    int msb = 63;
+    while ((us >> msb) == 0)
+      --msb;
+    int bucket = (msb - 2) * 8 + (int)((us >> (msb - 3)) & 7);
+    return bucket < num_buckets ? bucket : num_buckets - 1;
+  }
+
+  uint64_t Stats::Histogram::bucketUpperBound(int bucket) {
+    if (bucket < 8)
+      return (uint64_t)bucket;
+    int msb = bucket / 8 + 2;
+    uint64_t sub = (uint64_t)(bucket & 7);
+    return ((9 + sub) << (msb - 3)) - 1;
+  }
+
+  uint64_t Stats::Histogram::percentile(double p) const {
+    if (!count)
+      return 0;
+    uint64_t target = (uint64_t)(p * (double)count);
+    if (target >= count)
+      target = count - 1;
+    uint64_t accum = 0;
+    for (int i = 0; i < num_buckets; ++i) {
+      accum += counts[i];
+      if (accum > target)
+        return std::min(bucketUpperBound(i), max_us);
+    }
+    return max_us;
+  }
+
+  // The recording side of the Stats::Histogram
+  struct AtomicHistogram {
+    std::atomic< uint64_t > counts[Stats::Histogram::num_buckets];
+    std::atomic< uint64_t > count;
+    std::atomic< uint64_t > sum_us;
+    std::atomic< uint64_t > max_us;
+
+    AtomicHistogram() {
+      reset();
+    }
+
+    void reset() {
+      for (auto& c : counts)
+        c.store(0, std::memory_order_relaxed);
+      count.store(0, std::memory_order_relaxed);
+      sum_us.store(0, std::memory_order_relaxed);
+      max_us.store(0, std::memory_order_relaxed);
+    }
+
+    void add(uint64_t us) {
+      counts[Stats::Histogram::bucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+      count.fetch_add(1, std::memory_order_relaxed);
+      sum_us.fetch_add(us, std::memory_order_relaxed);
+      uint64_t prev_max = max_us.load(std::memory_order_relaxed);
+      while (us > prev_max && !max_us.compare_exchange_weak(prev_max, us, std::memory_order_relaxed)) { }
+    }
+
+    void snapshot(Stats::Histogram& h) const {
+      for (int i = 0; i < Stats::Histogram::num_buckets; ++i)
+        h.counts[i] = counts[i].load(std::memory_order_relaxed);
+      h.count = count.load(std::memory_order_relaxed);
+      h.sum_us = sum_us.load(std::memory_order_relaxed);
+      h.max_us = max_us.load(std::memory_order_relaxed);
+    }
+  };
+
+  struct OpMetrics {
+    const char* const       label;
+    std::atomic< uint64_t > requests;
+    std::atomic< uint64_t > errors;
+    std::atomic< uint64_t > replays;
+    std::atomic< uint64_t > new_connections;
+    std::atomic< uint64_t > bytes_sent;
+    std::atomic< uint64_t > bytes_sent_wire;
+    std::atomic< uint64_t > bytes_recv;
+    std::atomic< uint64_t > bytes_recv_wire;
+    AtomicHistogram         queue, dns, connect, tls, ttfb, transfer, total;
+
+    OpMetrics(const char* new_label) : label(new_label) {
+      reset();
+    }
+
+    void reset() {
+      for (auto c : { &requests, &errors, &replays, &new_connections, &bytes_sent, &bytes_sent_wire, &bytes_recv, &bytes_recv_wire })
+        c->store(0, std::memory_order_relaxed);
+      for (auto h : { &queue, &dns, &connect, &tls, &ttfb, &transfer, &total })
+        h->reset();
+    }
+
+    void snapshot(Stats::Op& op) const {
+      op.label = label;
+      op.requests = requests.load(std::memory_order_relaxed);
+      op.errors = errors.load(std::memory_order_relaxed);
+      op.replays = replays.load(std::memory_order_relaxed);
+      op.new_connections = new_connections.load(std::memory_order_relaxed);
+      op.bytes_sent = bytes_sent.load(std::memory_order_relaxed);
+      op.bytes_sent_wire = bytes_sent_wire.load(std::memory_order_relaxed);
+      op.bytes_recv = bytes_recv.load(std::memory_order_relaxed);
+      op.bytes_recv_wire = bytes_recv_wire.load(std::memory_order_relaxed);
+      queue.snapshot(op.queue);
+      dns.snapshot(op.dns);
+      connect.snapshot(op.connect);
+      tls.snapshot(op.tls);
+      ttfb.snapshot(op.ttfb);
+      transfer.snapshot(op.transfer);
+      total.snapshot(op.total);
+    }
+  };
+
+  // Written only by the thread calling Firestore::update, read by Firestore::stats from any thread
+  struct Metrics {
+    static const int max_labels = 32;
+    std::atomic< OpMetrics* > ops[max_labels];
+    std::atomic< uint32_t >   in_flight;
+    std::atomic< uint32_t >   held;
+    std::atomic< uint32_t >   deferred;
+    std::atomic< uint32_t >   free_requests;
+    std::atomic< double >     read_rate;
+    std::atomic< double >     write_rate;
+
+    Metrics() : in_flight(0), held(0), deferred(0), free_requests(0), read_rate(0.0), write_rate(0.0) {
+      for (auto& op : ops)
+        op.store(nullptr, std::memory_order_relaxed);
+    }
+
+    ~Metrics() {
+      for (auto& op : ops)
+        delete op.load(std::memory_order_relaxed);
+    }
+
+    // Allocates only the first time each label is seen. Labels are string literals,
+    // so comparing the pointers is usually enough
+    OpMetrics* find(const char* label) {
+      for (int i = 0; i < max_labels - 1; ++i) {
+        OpMetrics* op = ops[i].load(std::memory_order_acquire);
+        if (!op) {
+          op = new OpMetrics(label);
+          ops[i].store(op, std::memory_order_release);
+          return op;
+        }
+        if (op->label == label || strcmp(op->label, label) == 0)
+          return op;
+      }
+      // Too many labels, the rest are counted together in the last slot
+      OpMetrics* other = ops[max_labels - 1].load(std::memory_order_acquire);
+      if (!other) {
+        LOG(eLevel::Error, "More than %d labels of requests. '%s' and the next ones are counted as 'other'", max_labels - 1, label);
+        other = new OpMetrics("other");
+        ops[max_labels - 1].store(other, std::memory_order_release);
+      }
+      return other;
+    }
+  };
+
+  // -----------------------------------------
+  using Clock = std::chrono::steady_clock;
+
+  // The rate can be changed at any time
+  struct TokenBucket {
+    double            rate = 0.0;               // Tokens per second
+    double            tokens = 1.0;
+    Clock::time_point last_refill = Clock::now();
+
+    void setRate(double new_rate, Clock::time_point now) {
+      refill(now);
+      rate = new_rate;
+    }
+
+    void refill(Clock::time_point now) {
+      double elapsed = std::chrono::duration<double>(now - last_refill).count();
+      last_refill = now;
+      tokens = std::min(std::max(1.0, rate * Ctes::rate_limit_burst_secs), tokens + elapsed * rate);
+    }
+
+    bool ready(Clock::time_point now) {
+      refill(now);
+      return tokens >= 1.0;
+    }
+
+    void take() {
+      tokens -= 1.0;
+    }
+  };
+
+  // AIMD on top of a token bucket, for one class of requests
+  struct AdaptiveLimiter {
+    TokenBucket       bucket;
+    Clock::time_point blocked_until;            // From Retry-After
+    Clock::time_point last_decrease;
+
+    void reset(const RateLimits& limits, Clock::time_point now) {
+      bucket.setRate(limits.initial_rate, now);
+      blocked_until = now;
+      last_decrease = now - std::chrono::milliseconds(Ctes::rate_decrease_cooldown_ms);
+    }
+
+    bool ready(Clock::time_point now) {
+      return now >= blocked_until && bucket.ready(now);
+    }
+
+    void decrease(const RateLimits& limits, double factor, Clock::time_point now) {
+      if (now - last_decrease < std::chrono::milliseconds(Ctes::rate_decrease_cooldown_ms))
+        return;
+      last_decrease = now;
+      bucket.setRate(std::max(limits.min_rate, bucket.rate * factor), now);
+      LOG(eLevel::Log, "Rate limited to %1.1f requests/sec", bucket.rate);
+    }
+
+    void onThrottled(const RateLimits& limits, int retry_after_secs, Clock::time_point now) {
+      if (retry_after_secs > 0)
+        blocked_until = std::max(blocked_until, now + std::chrono::seconds(retry_after_secs));
+      decrease(limits, limits.decrease_factor, now);
+    }
+
+    // At full rate, the rate grows 'increase' each second
+    void onSuccess(const RateLimits& limits, Clock::time_point now) {
+      bucket.setRate(std::min(limits.max_rate, bucket.rate + limits.increase / bucket.rate), now);
+    }
+  };
+
+  static bool isCollection(const std::string& url);
+
+  static std::string collectionOf(const std::string& path) {
+    if (isCollection(path))
+      return path;
+    return path.substr(0, path.rfind('/'));
+  }
+
   // -----------------------------------------
+  // Lets a pre-callback of the library own the user callback without copying it, as C++11 lambdas
+  // can't move their captures. fn receives the result and the user callback
+  template< typename Fn >
+  struct WithCallback {
+    Fn              fn;
+    RequestCallback cb;
+    void operator()(Result& r) { fn(r, cb); }
+  };
+
+  template< typename Fn >
+  WithCallback< Fn > withCallback(RequestCallback&& cb, Fn fn) {
+    return WithCallback< Fn >{ std::move(fn), std::move(cb) };
+  }
+
   struct Request;
   static CURL* CurlPrepareRequest(Request* r, curl_slist* chunk);
 
@@ -97,11 +454,66 @@ namespace MiniFireStore
 
     std::string str_recv;
     std::string str_sent;
-    size_t      send_offset = 0;
+    SharedBody  prepared_body;              // Body serialized by the caller. Used instead of str_sent
+    std::string str_sent_gzip;              // Only used when the body is compressed
+
+    // The json body
+    const std::string& body() const {
+      return prepared_body ? prepared_body->text : str_sent;
+    }
 
-    const char* label = nullptr;            // Pure constant for debug
+    // What is handed to curl
+    const std::string& payload() const {
+      if (!(flags & RPC_FLAG_GZIP_BODY))
+        return body();
+      return (prepared_body && !prepared_body->gzip.empty()) ? prepared_body->gzip : str_sent_gzip;
+    }
+
+    int         retry_after_secs = -1;      // From the headers of the answer
+    long long   content_length = -1;        // Size of the answer on the wire, from the headers
+    bool        content_encoded = false;    // The answer is compressed
+    std::string collection;                 // Only for writes to collections with a write cap
+    const char* label = nullptr;            // Pure constant for debug. Also groups the stats
+    std::chrono::steady_clock::time_point created;
     int         flags = 0;
-    Callback    callback;
+    InlineCallback callback;
+    HeaderSetPtr headers;                   // Keeps the headers alive while curl uses them
+  };
+
+  // The multi handle and the sessions sending requests through it. Each request keeps
+  // the session which owns it in CURLOPT_PRIVATE
+  struct Transport::Impl {
+    CURLM* multi_handle = nullptr;
+    std::vector< Firestore::OTFRequests* > sessions;
+
+    Impl() {
+      multi_handle = curl_multi_init();
+    }
+    ~Impl() {
+      assert(sessions.empty());
+      curl_multi_cleanup(multi_handle);
+    }
+
+    void attach(Firestore::OTFRequests* otf) {
+      sessions.push_back(otf);
+    }
+    void detach(Firestore::OTFRequests* otf) {
+      sessions.erase(std::remove(sessions.begin(), sessions.end(), otf), sessions.end());
+    }
+
+    // The idle connections kept by curl default to 4 times the requests on the fly
+    void reserveConnections(long num_connections) {
+      if (num_connections <= max_connects)
+        return;
+      max_connects = num_connections;
+      curl_multi_setopt(multi_handle, CURLMOPT_MAXCONNECTS, max_connects);
+    }
+
+    bool update();
+    void wait(int timeout_ms);
+    bool hasFinished() const;
+
+    long max_connects = 0;
   };
 
   // This class is private of the Firestore OTF = On The Fly Requests
@@ -109,14 +521,46 @@ namespace MiniFireStore
     std::unordered_map< CURL*, Request* > on_the_fly_request;
     std::vector< Request* > free_requests;
     uint32_t                next_request_unique_id = 0;
-    CURLM* multi_handle = nullptr;
 
-    curl_slist* common_chunk = nullptr;
-    curl_slist* login_chunk = nullptr;
+    // Shared with other sessions, or owned when the db has no transport
+    Transport::Impl*        io = nullptr;
+    std::unique_ptr< Transport::Impl > own_io;
+
+    // Only used from the thread calling update(), so they are swapped without synchronization.
+    // The requests on the fly keep their own reference to the previous set
+    HeaderSetPtr common_headers;
+    HeaderSetPtr common_gzip_headers;
+    HeaderSetPtr login_headers;
+
+    // While the token is being refreshed, new requests wait here
+    Firestore*              db = nullptr;
+    bool                    refreshing_token = false;
+    std::vector< Request* > held_requests;
+
+    Metrics                 metrics;
+
+    // Requests waiting for the rate limits
+    std::vector< Request* > deferred_requests;
+    AdaptiveLimiter         read_limiter;
+    AdaptiveLimiter         write_limiter;
+    std::unordered_map< std::string, TokenBucket > collection_buckets;
+
+    // Functions to run from update() after a delay
+    struct Timer {
+      Clock::time_point     when;
+      std::function<void()> fn;
+    };
+    std::vector< Timer >    timers;
 
-    OTFRequests() {
-      multi_handle = curl_multi_init();
-      login_chunk = curl_slist_append(nullptr, Ctes::json_content_header);
+    OTFRequests(Firestore* new_db, Transport::Impl* shared_io) : db(new_db) {
+      if (!shared_io) {
+        own_io.reset(new Transport::Impl());
+        shared_io = own_io.get();
+      }
+      io = shared_io;
+      io->attach(this);
+      login_headers = std::make_shared< const HeaderSet >(std::initializer_list< std::string >{ Ctes::json_content_header });
+      resetLimits();
     }
 
     ~OTFRequests() {
@@ -125,26 +569,220 @@ namespace MiniFireStore
         unregisterRequest(it.first, it.second);
       on_the_fly_request.clear();
 
+      for (auto r : held_requests)
+        delete r;
+      held_requests.clear();
+
+      for (auto r : deferred_requests)
+        delete r;
+      deferred_requests.clear();
+
       for (auto r : free_requests)
         delete r;
       free_requests.clear();
 
-      curl_multi_cleanup(multi_handle);
-
-      if (common_chunk)
-        curl_slist_free_all(common_chunk);
+      io->detach(this);
+    }
 
-      curl_slist_free_all(login_chunk);
+    bool hasFinished() const {
+      return on_the_fly_request.empty() && held_requests.empty() && deferred_requests.empty() && timers.empty();
     }
 
     void setToken(const std::string& new_token) {
+      // The headers are shared between all new calls. The requests on the fly keep
+      // a reference to the previous set, which is released when the last one completes.
       std::string auth_header = Ctes::auth_bearer + new_token;
-      // The headers are shared between all calls.
-      if (common_chunk)
-        curl_slist_free_all(common_chunk);
-      common_chunk = nullptr;
-      common_chunk = curl_slist_append(common_chunk, Ctes::json_content_header);
-      common_chunk = curl_slist_append(common_chunk, auth_header.c_str());
+      HeaderSetPtr new_headers = std::make_shared< const HeaderSet >(std::initializer_list< std::string >{ Ctes::json_content_header, auth_header });
+      HeaderSetPtr new_gzip_headers = std::make_shared< const HeaderSet >(std::initializer_list< std::string >{ Ctes::json_content_header, Ctes::gzip_encoding_header, auth_header });
+      common_headers = std::move(new_headers);
+      common_gzip_headers = std::move(new_gzip_headers);
+    }
+
+    // New requests are not sent until releaseHeldRequests is called
+    void holdRequests() {
+      refreshing_token = true;
+    }
+
+    void holdRequest(Request* r) {
+      LOG(eLevel::Trace, "[%p] Request #%d (%s) waits for the token refresh", r, r->req_unique_id, r->label);
+      held_requests.push_back(r);
+    }
+
+    // If the refresh failed, the requests are sent anyway, but they will not be replayed again.
+    // The burst accumulated during the refresh still goes through the rate limits
+    void releaseHeldRequests(bool token_refreshed) {
+      refreshing_token = false;
+      std::vector< Request* > requests;
+      requests.swap(held_requests);
+      for (auto r : requests) {
+        if (!token_refreshed)
+          r->flags |= RPC_FLAG_REPLAYED;
+        sendOrDefer(r);
+      }
+      updateGauges();
+    }
+
+    // Applies the configuration of the db to the limiters
+    void resetLimits() {
+      auto now = Clock::now();
+      read_limiter.reset(db->rate_limits, now);
+      write_limiter.reset(db->rate_limits, now);
+      collection_buckets.clear();
+      for (auto& it : db->collection_write_rates)
+        collection_buckets[it.first].setRate(it.second, now);
+    }
+
+    AdaptiveLimiter* limiterOf(const Request* r) {
+      if (!db->rate_limits.enabled || (r->flags & RPC_FLAG_CONNECT))
+        return nullptr;
+      return (r->flags & RPC_FLAG_WRITE) ? &write_limiter : &read_limiter;
+    }
+
+    // Takes the tokens required to send the request now
+    bool acquireTokens(const Request* r, Clock::time_point now) {
+      AdaptiveLimiter* limiter = limiterOf(r);
+      TokenBucket* cap = nullptr;
+      if (!r->collection.empty()) {
+        auto it = collection_buckets.find(r->collection);
+        if (it != collection_buckets.end())
+          cap = &it->second;
+      }
+      if ((limiter && !limiter->ready(now)) || (cap && !cap->ready(now)))
+        return false;
+      if (limiter)
+        limiter->bucket.take();
+      if (cap)
+        cap->take();
+      return true;
+    }
+
+    // New requests wait behind the ones already deferred
+    void sendOrDefer(Request* r) {
+      if (deferred_requests.empty() && acquireTokens(r, Clock::now())) {
+        registerRequest(r);
+        return;
+      }
+      LOG(eLevel::Trace, "[%p] Request #%d (%s) deferred by the rate limits", r, r->req_unique_id, r->label);
+      deferred_requests.push_back(r);
+    }
+
+    bool runTimers() {
+      if (timers.empty())
+        return false;
+      auto now = Clock::now();
+      std::vector< Timer > due;
+      size_t num_kept = 0;
+      for (size_t i = 0; i < timers.size(); ++i) {
+        if (timers[i].when <= now)
+          due.push_back(std::move(timers[i]));
+        else
+          timers[num_kept++] = std::move(timers[i]);
+      }
+      timers.resize(num_kept);
+      // The functions can add new timers
+      for (auto& t : due)
+        t.fn();
+      return !due.empty();
+    }
+
+    int msUntilNextTimer() const {
+      auto next = timers[0].when;
+      for (auto& t : timers)
+        next = std::min(next, t.when);
+      auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(next - Clock::now()).count();
+      return ms > 0 ? (int)ms : 0;
+    }
+
+    // Keeps the order of the requests still deferred
+    bool sendDeferred() {
+      if (deferred_requests.empty())
+        return false;
+      auto now = Clock::now();
+      size_t num_kept = 0;
+      for (size_t i = 0; i < deferred_requests.size(); ++i) {
+        Request* r = deferred_requests[i];
+        if (acquireTokens(r, now))
+          registerRequest(r);
+        else
+          deferred_requests[num_kept++] = r;
+      }
+      bool sent = num_kept != deferred_requests.size();
+      deferred_requests.resize(num_kept);
+      return sent;
+    }
+
+    // Adapts the rate to the answers of the server
+    void onAnswer(const Request* r, const Tracer::Span& span) {
+      AdaptiveLimiter* limiter = limiterOf(r);
+      if (!limiter)
+        return;
+      const RateLimits& limits = db->rate_limits;
+      const Result& result = r->result;
+      if (result.http_status == 429 || result.http_status == 503 || result.grpc_status == "RESOURCE_EXHAUSTED" || result.grpc_status == "UNAVAILABLE") {
+        limiter->onThrottled(limits, result.retry_after_secs, span.end_time);
+        return;
+      }
+      uint64_t server_us = span.dns_us + span.connect_us + span.tls_us + span.send_us + span.ttfb_us + span.transfer_us;
+      if (limits.slow_answer_ms > 0 && server_us > (uint64_t)limits.slow_answer_ms * 1000)
+        limiter->decrease(limits, Ctes::slow_answer_decrease_factor, span.end_time);
+      else if (!result.err || result.grpc_status == "NOT_FOUND")
+        limiter->onSuccess(limits, span.end_time);
+    }
+
+    // Fills http_status, curl_code and grpc_status, and parses the body to json when it's not an error.
+    // Returns true when the request failed
+    static bool checkAnswer(CURL* curl, CURLcode curl_code, Request* r) {
+      Result& result = r->result;
+      result.curl_code = (int)curl_code;
+      result.retry_after_secs = r->retry_after_secs;
+      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &result.http_status);
+
+      if (curl_code != CURLE_OK) {
+        result.grpc_status = (curl_code == CURLE_OPERATION_TIMEDOUT) ? "DEADLINE_EXCEEDED" : "UNAVAILABLE";
+        return true;
+      }
+
+      if (result.http_status < 200 || result.http_status >= 300) {
+        const char* status = grpcStatusOfErrorBody(r->str_recv);
+        result.grpc_status = status ? status : grpcStatusOfHttp(result.http_status);
+        // The auth errors tell the reason in the body
+        if (r->flags & RPC_FLAG_CONNECT)
+          result.j = json::parse(r->str_recv, nullptr, false);
+        return true;
+      }
+
+      if (r->str_recv.empty()) {
+        result.grpc_status = "UNKNOWN";
+        return true;
+      }
+
+      // Parse the results back to json
+      json& j = result.j;
+      j = json::parse(r->str_recv, nullptr, false);
+      if (j.is_discarded()) {
+        result.grpc_status = "DATA_LOSS";
+        return true;
+      }
+
+      // The streamed answers of runQuery can fail after the 200
+      const json& jerr = (j.is_array() && !j.empty()) ? j[0] : j;
+      if (jerr.is_object() && jerr.contains("error")) {
+        const json& jstatus = jerr["error"]["status"];
+        result.grpc_status = jstatus.is_string() ? jstatus.get<std::string>() : "UNKNOWN";
+        return true;
+      }
+
+      // The time of the write, from the commit answers or the doc returned by add and patch
+      if ((r->flags & RPC_FLAG_WRITE) && j.is_object()) {
+        auto it = j.find("writeResults");
+        const json& jwrite = (it != j.end() && it->is_array() && !it->empty()) ? (*it)[0] : j;
+        auto it_time = jwrite.find("updateTime");
+        if (it_time != jwrite.end() && it_time->is_string())
+          result.update_time = it_time->get<std::string>();
+      }
+
+      result.grpc_status = "OK";
+      return false;
     }
 
     Request* newRequest() {
@@ -156,7 +794,7 @@ namespace MiniFireStore
       }
       else {
         r = new Request();
-        log(eLevel::Trace, "[%p] alloc new", r);
+        LOG(eLevel::Trace, "[%p] alloc new", r);
       }
       // Request and result have the same unique id
       r->req_unique_id = ++next_request_unique_id;
@@ -165,108 +803,324 @@ namespace MiniFireStore
     }
 
     void registerRequest(Request* r) {
+      r->retry_after_secs = -1;
+      r->content_length = -1;
+      r->content_encoded = false;
 
       // Prepare the curl request and add it to the async api
-      CURL* curl = CurlPrepareRequest(r, (r->flags & RPC_FLAG_CONNECT) ? login_chunk : common_chunk);
+      if (r->flags & RPC_FLAG_CONNECT)
+        r->headers = login_headers;
+      else
+        r->headers = (r->flags & RPC_FLAG_GZIP_BODY) ? common_gzip_headers : common_headers;
+      CURL* curl = CurlPrepareRequest(r, r->headers ? r->headers->chunk : nullptr);
       assert(curl);
 
       // move it to on_the_fly_request
       on_the_fly_request[curl] = r;
 
-      curl_multi_add_handle(multi_handle, curl);
+      curl_easy_setopt(curl, CURLOPT_PRIVATE, this);
+      curl_multi_add_handle(io->multi_handle, curl);
     }
 
     void unregisterRequest(CURL* curl, Request* r) {
       assert(curl);
       assert(r);
 
-      // Now we can reuse the request
+      curl_multi_remove_handle(io->multi_handle, curl);
+
+      curl_easy_cleanup(curl);
+
+      // curl no longer uses the headers. Now we can reuse the request
+      r->headers.reset();
+      r->prepared_body.reset();
+      r->callback.reset();
+      releaseLargeBuffer(r->str_recv);
+      releaseLargeBuffer(r->str_sent);
+      releaseLargeBuffer(r->str_sent_gzip);
       free_requests.push_back(r);
 
-      log(eLevel::Trace, "[%p] returns to the pool (now %ld)", r, free_requests.size());
+      LOG(eLevel::Trace, "[%p] returns to the pool (now %ld)", r, free_requests.size());
+    }
 
-      curl_multi_remove_handle(multi_handle, curl);
+    // Don't let a single huge answer pin memory in the pool forever
+    static void releaseLargeBuffer(std::string& buf) {
+      if (buf.capacity() > Ctes::max_pooled_buffer_capacity)
+        std::string().swap(buf);
+      else
+        buf.clear();
+    }
 
-      curl_easy_cleanup(curl);
+    // Timers and the requests waiting for the rate limits
+    bool runScheduled() {
+      bool work_done = runTimers();
+      work_done |= sendDeferred();
+      if (work_done)
+        updateGauges();
+      return work_done;
     }
 
-    bool update() {
-      assert(multi_handle);
+    // Called by the transport when curl finishes one of our requests
+    void complete(CURL* curl, CURLcode curl_code) {
+      assert(curl);
 
-      int num_handles = (int)on_the_fly_request.size();
-      CURLMcode rc = curl_multi_perform(multi_handle, &num_handles);
-      if (rc) {
-        log(eLevel::Error, "curl_multi_perform() failed, code %d.", (int)rc);
-        return false;
+      auto it = on_the_fly_request.find(curl);
+      assert(it != on_the_fly_request.end());
+
+      // Dispatch the callback
+      Request* r = it->second;
+      assert(r);
+
+      LOG(eLevel::Trace, "[%p] Request #%d(%s) completes", r, r->req_unique_id, r->label);
+      LOG_PAYLOAD(eLevel::Trace, r->str_recv);
+
+      bool error_detected = checkAnswer(curl, curl_code, r);
+      if (r->flags & RPC_FLAG_PREWARM)
+        error_detected = curl_code != CURLE_OK;
+
+      // The token was rejected. Send the request again once we have a fresh token
+      if (error_detected && (r->flags & (RPC_FLAG_CONNECT | RPC_FLAG_REPLAYED)) == 0 && r->result.grpc_status == "UNAUTHENTICATED") {
+        LOG(eLevel::Log, "[%p] Request #%d(%s) unauthenticated. Will be replayed", r, r->req_unique_id, r->label);
+        on_the_fly_request.erase(it);
+        curl_multi_remove_handle(io->multi_handle, curl);
+        curl_easy_cleanup(curl);
+        r->headers.reset();
+        r->flags |= RPC_FLAG_REPLAYED;
+        metrics.find(r->label)->replays.fetch_add(1, std::memory_order_relaxed);
+        r->result = Result();
+        r->result.req_unique_id = r->req_unique_id;
+        r->str_recv.clear();
+        holdRequest(r);
+        if (!refreshing_token)
+          db->refreshToken();
+        updateGauges();
+        return;
       }
 
-      bool work_done = false;
+      // Check for obvious errors
+      if (error_detected) {
+        LOG(eLevel::Error, "%s(%s,%s) Err: %ld %s %s", r->label, r->url.c_str(), r->body().c_str(), r->result.http_status, r->result.grpc_status.c_str(), r->str_recv.c_str());
+        r->result.err = -1;
+      }
+      else {
+        r->result.err = 0;
+      }
 
-      struct CURLMsg* m = nullptr;
-      do {
-        int msgq = 0;
-        m = curl_multi_info_read(multi_handle, &msgq);
-        if (m && (m->msg == CURLMSG_DONE)) {
-
-          CURL* curl = m->easy_handle;
-          assert(curl);
-
-          auto it = on_the_fly_request.find(curl);
-          assert(it != on_the_fly_request.end());
-
-          // Dispatch the callback
-          Request* r = it->second;
-          assert(r);
-
-          log(eLevel::Trace, "[%p] Request #%d(%s) completes", r, r->req_unique_id, r->label);
-          log(eLevel::Trace, "%s", r->str_recv.c_str());
-
-          bool error_detected = r->str_recv.empty();
-          if (!error_detected) {
-            // Parse the results back to json
-            json& j = r->result.j;
-            j = json::parse(r->str_recv, nullptr, false);
-            if (j.is_discarded()) {
-              error_detected = true;
-            }
-            else {
-              error_detected = j.contains("error") || (j.is_array() && j[0].contains("error"));
-            }
-          }
+      // If we are inside a callback waiting to fs to finish, this request is no longer on the fly
+      on_the_fly_request.erase(it);
+
+      // Sizes on the wire and after decoding
+      curl_off_t wire_size = 0;
+      r->result.bytes_sent = r->body().size();
+      r->result.bytes_sent_wire = r->payload().size();
+      r->result.bytes_recv = r->str_recv.size();
+      if (curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &wire_size) == CURLE_OK)
+        r->result.bytes_recv_wire = (size_t)wire_size;
+      Tracer::Span span;
+      readPhases(curl, r, span);
+      recordMetrics(r, span);
+      onAnswer(r, span);
+      if (db->tracer) {
+        fillSpan(r, span);
+        span.err = r->result.err;
+        span.http_status = r->result.http_status;
+        span.recv_size = r->str_recv.size();
+        db->tracer->end(span);
+      }
 
-          // Check for obvious errors
-          if (error_detected) {
-            log(eLevel::Error, "%s(%s,%s) Err: %s", r->label, r->url.c_str(), r->str_sent.c_str(), r->str_recv.c_str());
-            r->result.err = -1;
-          }
-          else {
-            r->result.err = 0;
-          }
+      // Move the recv str to the result object
+      r->result.str.swap(r->str_recv);
 
-          // If we are inside a callback waiting to fs to finish, this request is no longer on the fly
-          on_the_fly_request.erase(it);
+      r->callback(r->result);
 
-          // Move the recv str to the result object
-          r->result.str = std::move(r->str_recv);
+      // Recover the buffer, so the reserved memory can be reused by the next request
+      r->str_recv.swap(r->result.str);
+      r->result.str.clear();
+      r->result.j = json();
 
-          r->callback(r->result);
+      unregisterRequest(curl, r);
+      updateGauges();
+    }
 
-          unregisterRequest(curl, r);
+    void updateGauges() {
+      metrics.in_flight.store((uint32_t)on_the_fly_request.size(), std::memory_order_relaxed);
+      metrics.held.store((uint32_t)held_requests.size(), std::memory_order_relaxed);
+      metrics.deferred.store((uint32_t)deferred_requests.size(), std::memory_order_relaxed);
+      bool limited = db->rate_limits.enabled;
+      metrics.read_rate.store(limited ? read_limiter.bucket.rate : 0.0, std::memory_order_relaxed);
+      metrics.write_rate.store(limited ? write_limiter.bucket.rate : 0.0, std::memory_order_relaxed);
+      metrics.free_requests.store((uint32_t)free_requests.size(), std::memory_order_relaxed);
+    }
 
-          work_done = true;
-        }
-      } while (m);
+    // Splits the life of the request in consecutive phases, using the curl timings
+    static void readPhases(CURL* curl, Request* r, Tracer::Span& span) {
+      // All the curl times are in us since the transfer started
+      curl_off_t t_dns = 0, t_connect = 0, t_tls = 0, t_pretransfer = 0, t_start = 0, t_total = 0;
+      long num_connects = 0;
+      curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &t_dns);
+      curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &t_connect);
+      curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &t_tls);
+      curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &t_pretransfer);
+      curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &t_start);
+      curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &t_total);
+      curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &num_connects);
+
+      auto delta = [](curl_off_t to, curl_off_t from) -> uint64_t {
+        return to > from ? (uint64_t)(to - from) : 0;
+      };
+
+      span.begin_time = r->created;
+      span.end_time = std::chrono::steady_clock::now();
+      int64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(span.end_time - r->created).count();
+
+      // Whatever was not spent inside curl: held for a token refresh, or waiting for update()
+      span.queue_us = delta(elapsed, t_total);
+      span.new_connection = num_connects > 0;
+      if (span.new_connection) {
+        span.dns_us = (uint64_t)t_dns;
+        span.connect_us = delta(t_connect, t_dns);
+        span.tls_us = t_tls > 0 ? delta(t_tls, t_connect) : 0;
+      }
+      span.send_us = delta(t_pretransfer, span.dns_us + span.connect_us + span.tls_us);
+      if (t_start > 0) {
+        span.ttfb_us = delta(t_start, t_pretransfer);
+        span.transfer_us = delta(t_total, t_start);
+      }
+    }
 
-      return work_done;
+    void recordMetrics(const Request* r, const Tracer::Span& span) {
+      OpMetrics* op = metrics.find(r->label);
+      op->requests.fetch_add(1, std::memory_order_relaxed);
+      if (r->result.err)
+        op->errors.fetch_add(1, std::memory_order_relaxed);
+      op->bytes_sent.fetch_add(r->result.bytes_sent, std::memory_order_relaxed);
+      op->bytes_sent_wire.fetch_add(r->result.bytes_sent_wire, std::memory_order_relaxed);
+      op->bytes_recv.fetch_add(r->result.bytes_recv, std::memory_order_relaxed);
+      op->bytes_recv_wire.fetch_add(r->result.bytes_recv_wire, std::memory_order_relaxed);
+
+      op->queue.add(span.queue_us);
+      if (span.new_connection) {
+        op->new_connections.fetch_add(1, std::memory_order_relaxed);
+        op->dns.add(span.dns_us);
+        op->connect.add(span.connect_us);
+        if (span.tls_us)
+          op->tls.add(span.tls_us);
+      }
+      if (span.ttfb_us || span.transfer_us) {
+        op->ttfb.add(span.ttfb_us);
+        op->transfer.add(span.transfer_us);
+      }
+      op->total.add((uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(span.end_time - span.begin_time).count());
+    }
+
+    // Only the path, without the host, and without the query which might contain the api key
+    static std::string pathOfUrl(const std::string& url) {
+      size_t start = url.find("://");
+      start = url.find('/', start == std::string::npos ? 0 : start + 3);
+      if (start == std::string::npos)
+        return std::string();
+      return url.substr(start, url.find('?', start) - start);
+    }
+
+    static void fillSpan(const Request* r, Tracer::Span& span) {
+      span.req_unique_id = r->req_unique_id;
+      span.label = r->label;
+      span.path = pathOfUrl(r->url);
+      span.body_size = r->body().size();
+      span.retries = (r->flags & RPC_FLAG_REPLAYED) ? 1 : 0;
+      span.begin_time = r->created;
     }
 
   };
 
-  uint32_t Firestore::allocRequest(const std::string& url_suffix, const json& jbody, Callback callback, const char* label, int flags) {
+  // -----------------------------------------
+  bool Transport::Impl::update() {
+    assert(multi_handle);
+
+    // The callbacks can attach and detach sessions, so don't keep iterators
+    bool work_done = false;
+    for (size_t i = 0; i < sessions.size(); ++i) {
+      Firestore::OTFRequests* otf = sessions[i];
+      otf->db->checkTokenExpiration();
+      work_done |= otf->runScheduled();
+    }
+
+    int num_handles = 0;
+    CURLMcode rc = curl_multi_perform(multi_handle, &num_handles);
+    if (rc) {
+      LOG(eLevel::Error, "curl_multi_perform() failed, code %d.", (int)rc);
+      return false;
+    }
+
+    struct CURLMsg* m = nullptr;
+    do {
+      int msgq = 0;
+      m = curl_multi_info_read(multi_handle, &msgq);
+      if (m && (m->msg == CURLMSG_DONE)) {
+        char* owner = nullptr;
+        curl_easy_getinfo(m->easy_handle, CURLINFO_PRIVATE, &owner);
+        assert(owner);
+        ((Firestore::OTFRequests*)owner)->complete(m->easy_handle, m->data.result);
+        work_done = true;
+      }
+    } while (m);
+
+    return work_done;
+  }
+
+  void Transport::Impl::wait(int timeout_ms) {
+    // The deferred requests are sent by update()
+    for (auto otf : sessions) {
+      if (!otf->deferred_requests.empty())
+        timeout_ms = std::min(timeout_ms, Ctes::deferred_poll_ms);
+      if (!otf->timers.empty())
+        timeout_ms = std::min(timeout_ms, otf->msUntilNextTimer());
+    }
+    curl_multi_poll(multi_handle, nullptr, 0, timeout_ms, nullptr);
+  }
+
+  bool Transport::Impl::hasFinished() const {
+    for (auto otf : sessions) {
+      if (!otf->hasFinished())
+        return false;
+    }
+    return true;
+  }
+
+  Transport::Transport() : impl(new Impl()) {
+  }
+
+  Transport::~Transport() {
+    // Nothing can be sent without the multi handle
+    while (!impl->sessions.empty()) {
+      Firestore* db = impl->sessions.back()->db;
+      LOG(eLevel::Log, "Transport destroyed. Disconnecting session %s", db->uid().c_str());
+      db->transport = nullptr;
+      db->disconnect();
+    }
+    delete impl;
+  }
+
+  bool Transport::update() {
+    return impl->update();
+  }
+
+  void Transport::wait(int timeout_ms) {
+    impl->wait(timeout_ms);
+  }
+
+  bool Transport::hasFinished() const {
+    return impl->hasFinished();
+  }
+
+  size_t Transport::numSessions() const {
+    return impl->sessions.size();
+  }
+
+  uint32_t Firestore::allocRequest(const std::string& url_suffix, const json& jbody, InlineCallback callback, const char* label, int flags, const SharedBody& prepared_body, const std::string& doc_path) {
 
     assert(label);
     if (!otf) {
-      log(eLevel::Error, "Not connected");
+      LOG(eLevel::Error, "Not connected");
       return 0;
     }
 
@@ -285,36 +1139,380 @@ namespace MiniFireStore
     r->result = Result();
     r->url = url;
     r->str_recv.clear();
-    if( !jbody.is_null() )
-      r->str_sent = jbody.dump((flags & RPC_FLAG_TRACE) ? 2 : 0, ' ');
-    else
+    r->prepared_body = prepared_body;
+    if (prepared_body || jbody.is_null())
       r->str_sent.clear();
-    r->send_offset = 0;
+    else
+      r->str_sent = jbody.dump((flags & RPC_FLAG_TRACE) ? 2 : 0, ' ');
+    if (compress_responses)
+      flags |= RPC_FLAG_ACCEPT_ENCODING;
+    if (gzip_requests_min_size && r->body().size() >= gzip_requests_min_size && (flags & RPC_FLAG_CONNECT) == 0) {
+      // The prepared bodies are compressed once by prepareWrite
+      if ((prepared_body && !prepared_body->gzip.empty()) || gzipCompress(r->body(), r->str_sent_gzip))
+        flags |= RPC_FLAG_GZIP_BODY;
+    }
     r->label = label;
     r->flags = flags;
-    r->callback = callback;
+    r->callback = std::move(callback);
+    r->created = std::chrono::steady_clock::now();
+    if ((flags & RPC_FLAG_WRITE) && !doc_path.empty() && !collection_write_rates.empty())
+      r->collection = collectionOf(doc_path);
+    else
+      r->collection.clear();
+    if (tracer) {
+      Tracer::Span span;
+      otf->fillSpan(r, span);
+      tracer->begin(span);
+    }
 
-    log(eLevel::Trace, "[%p] Request added #%d (%s)", r, r->req_unique_id, label);
-    otf->registerRequest(r);
+    LOG(eLevel::Trace, "[%p] Request added #%d (%s)", r, r->req_unique_id, label);
+    if ((flags & RPC_FLAG_CONNECT) == 0) {
+      checkTokenExpiration();
+      if (otf->refreshing_token) {
+        otf->holdRequest(r);
+        otf->updateGauges();
+        return r->req_unique_id;
+      }
+    }
+    otf->sendOrDefer(r);
+    otf->updateGauges();
 
     return r->req_unique_id;
   }
 
+  void Firestore::setCompression(bool new_compress_responses, size_t new_gzip_requests_min_size) {
+    compress_responses = new_compress_responses;
+    gzip_requests_min_size = new_gzip_requests_min_size;
+#ifndef MINI_FIRESTORE_ZLIB
+    if (gzip_requests_min_size)
+      LOG(eLevel::Error, "Compressed requests require building with MINI_FIRESTORE_ZLIB");
+    gzip_requests_min_size = 0;
+#endif
+  }
+
   bool Firestore::hasFinished() const {
-    return otf && otf->on_the_fly_request.empty();
+    return otf && otf->hasFinished();
+  }
+
+  void Firestore::setRateLimits(const RateLimits& new_rate_limits) {
+    rate_limits = new_rate_limits;
+    if (otf)
+      otf->resetLimits();
+  }
+
+  void Firestore::setCollectionWriteRate(const std::string& collection_path, double writes_per_sec) {
+    if (writes_per_sec > 0.0)
+      collection_write_rates[collection_path] = writes_per_sec;
+    else
+      collection_write_rates.erase(collection_path);
+    if (otf)
+      otf->resetLimits();
   }
 
   void Firestore::dump() const {
     if (otf) {
       for (auto it : otf->on_the_fly_request) {
         Request* r = it.second;
-        log(eLevel::Log, "[%p] %s %s", r, r->label, r->url.c_str());
+        LOG(eLevel::Log, "[%p] %s %s", r, r->label, r->url.c_str());
+      }
+    }
+  }
+
+  Stats Firestore::stats() const {
+    Stats stats;
+    if (!otf)
+      return stats;
+    const Metrics& metrics = otf->metrics;
+    for (auto& slot : metrics.ops) {
+      const OpMetrics* op = slot.load(std::memory_order_acquire);
+      if (!op)
+        break;
+      stats.ops.emplace_back();
+      op->snapshot(stats.ops.back());
+    }
+    stats.in_flight = metrics.in_flight.load(std::memory_order_relaxed);
+    stats.held = metrics.held.load(std::memory_order_relaxed);
+    stats.deferred = metrics.deferred.load(std::memory_order_relaxed);
+    stats.read_rate = metrics.read_rate.load(std::memory_order_relaxed);
+    stats.write_rate = metrics.write_rate.load(std::memory_order_relaxed);
+    stats.free_requests = metrics.free_requests.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+  void Firestore::resetStats() {
+    if (!otf)
+      return;
+    for (auto& slot : otf->metrics.ops) {
+      OpMetrics* op = slot.load(std::memory_order_acquire);
+      if (!op)
+        break;
+      op->reset();
+    }
+  }
+
+  static void to_json(json& j, const Stats::Histogram& h) {
+    j = {
+      {"count", h.count},
+      {"mean_us", h.mean()},
+      {"p50_us", h.percentile(0.50)},
+      {"p99_us", h.percentile(0.99)},
+      {"p999_us", h.percentile(0.999)},
+      {"max_us", h.max_us},
+    };
+  }
+
+  void to_json(json& j, const Stats& stats) {
+    json jops = json::value_t::array;
+    for (auto& op : stats.ops) {
+      jops.push_back({
+        {"label", op.label},
+        {"requests", op.requests},
+        {"errors", op.errors},
+        {"replays", op.replays},
+        {"new_connections", op.new_connections},
+        {"bytes_sent", op.bytes_sent},
+        {"bytes_sent_wire", op.bytes_sent_wire},
+        {"bytes_recv", op.bytes_recv},
+        {"bytes_recv_wire", op.bytes_recv_wire},
+        {"queue", op.queue},
+        {"dns", op.dns},
+        {"connect", op.connect},
+        {"tls", op.tls},
+        {"ttfb", op.ttfb},
+        {"transfer", op.transfer},
+        {"total", op.total},
+      });
+    }
+    j = {
+      {"ops", jops},
+      {"in_flight", stats.in_flight},
+      {"held", stats.held},
+      {"deferred", stats.deferred},
+      {"read_rate", stats.read_rate},
+      {"write_rate", stats.write_rate},
+      {"free_requests", stats.free_requests},
+    };
+  }
+
+  // -----------------------------------------
+  void ChromeTraceExporter::end(const Span& span) {
+    spans.push_back(span);
+  }
+
+  json ChromeTraceExporter::toJson() const {
+    json events = json::value_t::array;
+    if (spans.empty())
+      return { { "traceEvents", events } };
+
+    auto t0 = spans[0].begin_time;
+    for (auto& span : spans)
+      t0 = std::min(t0, span.begin_time);
+
+    // Each request is an async span, so the overlapping requests are shown in different rows.
+    // The phases are nested inside, one after the other
+    for (auto& span : spans) {
+      double ts = (double)std::chrono::duration_cast<std::chrono::microseconds>(span.begin_time - t0).count();
+      auto event = [&](const char* name, const char* phase, double t) {
+        json e = {
+          {"name", name},
+          {"cat", "firestore"},
+          {"ph", phase},
+          {"id", span.req_unique_id},
+          {"ts", t},
+          {"pid", 1},
+          {"tid", 1},
+        };
+        return e;
+      };
+
+      json jbegin = event(span.label ? span.label : "request", "b", ts);
+      jbegin["args"] = {
+        {"path", span.path},
+        {"body_size", span.body_size},
+        {"recv_size", span.recv_size},
+        {"http_status", span.http_status},
+        {"err", span.err},
+        {"retries", span.retries},
+        {"new_connection", span.new_connection},
+      };
+      events.push_back(jbegin);
+
+      const std::pair< const char*, uint64_t > phases[] = {
+        { "queue", span.queue_us },
+        { "dns", span.dns_us },
+        { "connect", span.connect_us },
+        { "tls", span.tls_us },
+        { "send", span.send_us },
+        { "ttfb", span.ttfb_us },
+        { "transfer", span.transfer_us },
+      };
+      double t = ts;
+      for (auto& phase : phases) {
+        if (!phase.second)
+          continue;
+        events.push_back(event(phase.first, "b", t));
+        t += (double)phase.second;
+        events.push_back(event(phase.first, "e", t));
       }
+
+      double ts_end = (double)std::chrono::duration_cast<std::chrono::microseconds>(span.end_time - t0).count();
+      events.push_back(event(span.label ? span.label : "request", "e", std::max(t, ts_end)));
+    }
+    return { { "traceEvents", events }, { "displayTimeUnit", "ms" } };
+  }
+
+  bool ChromeTraceExporter::save(const std::string& filename) const {
+    FILE* f = fopen(filename.c_str(), "wb");
+    if (!f) {
+      LOG(eLevel::Error, "Failed to create trace file %s", filename.c_str());
+      return false;
     }
+    std::string str = toJson().dump();
+    bool ok = fwrite(str.data(), 1, str.size(), f) == str.size();
+    fclose(f);
+    return ok;
+  }
+
+  // -----------------------------------------
+  struct Transaction::State {
+    Firestore*      db = nullptr;
+    std::string     id;
+    TransactionBody body;
+    Callback        cb;
+    json            writes = json::value_t::array;
+    int             attempt = 0;
+    int             max_attempts = 1;
+    bool            ended = false;            // commit or abort already called
+  };
+
+  void Firestore::schedule(int delay_ms, std::function<void()> fn) {
+    if (!otf)
+      return;
+    otf->timers.push_back({ Clock::now() + std::chrono::milliseconds(delay_ms), fn });
+  }
+
+  void Firestore::runTransaction(TransactionBody body, Callback cb, int max_attempts) {
+    auto state = std::make_shared< Transaction::State >();
+    state->db = this;
+    state->body = body;
+    state->cb = cb;
+    state->max_attempts = std::max(1, max_attempts);
+    beginTransaction(state, std::string());
+  }
+
+  void Firestore::beginTransaction(std::shared_ptr< Transaction::State > state, const std::string& retry_id) {
+    json jbody = json::value_t::object;
+    if (!retry_id.empty())
+      jbody["options"] = { {"readWrite", {{"retryTransaction", retry_id}}} };
+
+    auto pre_cb = [state](Result& result) {
+      if (result.err) {
+        state->cb(result);
+        return;
+      }
+      state->id = result.j.value("transaction", "");
+      state->writes = json::value_t::array;
+      state->ended = false;
+      state->attempt++;
+      Transaction tr;
+      tr.state = state;
+      state->body(tr);
+    };
+    allocRequest(":beginTransaction", jbody, pre_cb, "beginTransaction");
+  }
+
+  uint32_t Transaction::read(const Ref& ref, Callback cb) const {
+    assert(ref.db == state->db);
+    return ref.readDoc(std::move(cb), &state->id);
+  }
+
+  void Transaction::write(const Ref& ref, const json& j) const {
+    assert(!state->ended);
+    state->writes.push_back(ref.updateWrite(j));
+  }
+
+  void Transaction::del(const Ref& ref) const {
+    assert(!state->ended);
+    state->writes.push_back({ {"delete", state->db->doc_root + ref.doc_id} });
+  }
+
+  int Transaction::attempt() const {
+    return state->attempt;
+  }
+
+  void Transaction::commit() const {
+    assert(!state->ended);
+    state->ended = true;
+    json jbody = {
+      {"writes", std::move(state->writes)},
+      {"transaction", state->id},
+    };
+    state->writes = json::value_t::array;
+
+    std::shared_ptr< State > s = state;
+    auto pre_cb = [s](Result& result) {
+      if (result.err && result.grpc_status == "ABORTED" && s->attempt < s->max_attempts) {
+        // Someone else modified the docs we read. Run the body again in a new transaction
+        int backoff_ms = std::min(Ctes::transaction_max_backoff_ms, Ctes::transaction_backoff_ms << (s->attempt - 1));
+        // Some jitter so the contenders don't retry at the same time
+        backoff_ms += (int)(Clock::now().time_since_epoch().count() % (backoff_ms / 2 + 1));
+        LOG(eLevel::Log, "Transaction aborted (attempt %d). Retrying in %d ms", s->attempt, backoff_ms);
+        std::string retry_id = s->id;
+        s->db->schedule(backoff_ms, [s, retry_id]() {
+          s->db->beginTransaction(s, retry_id);
+        });
+        return;
+      }
+      s->cb(result);
+    };
+    state->db->allocRequest(":commit", jbody, pre_cb, "transaction", RPC_FLAG_WRITE);
+  }
+
+  void Transaction::abort() const {
+    assert(!state->ended);
+    state->ended = true;
+    state->writes = json::value_t::array;
+    std::shared_ptr< State > s = state;
+    auto pre_cb = [s](Result& result) {
+      result.err = ERR_TRANSACTION_ABORTED;
+      s->cb(result);
+    };
+    state->db->allocRequest(":rollback", { {"transaction", state->id} }, pre_cb, "rollback");
+  }
+
+  void Firestore::wait(int timeout_ms) {
+    if (!otf)
+      return;
+    otf->io->wait(timeout_ms);
   }
 
   bool Firestore::update() {
-    return otf && otf->update();
+    if (!otf)
+      return false;
+    return otf->io->update();
+  }
+
+  void Firestore::prewarm(int num_connections) {
+    if (!otf) {
+      LOG(eLevel::Error, "prewarm must be called after configure");
+      return;
+    }
+    // Unauthenticated GETs, so they can be sent before the login. The error answers are
+    // small and leave the connection in the cache of curl for the next requests
+    std::string urls[] = { url_root, serviceUrl(Ctes::api_verify_password_host) };
+    otf->io->reserveConnections(Ctes::default_max_connects + num_connections * 2);
+    for (const std::string& url : urls) {
+      for (int i = 0; i < num_connections; ++i)
+        allocRequest(url, json(), [](Result&) {}, "prewarm", RPC_FLAG_CONNECT | RPC_FLAG_GET | RPC_FLAG_PREWARM);
+    }
+  }
+
+  void Firestore::setTransport(Transport* new_transport) {
+    if (otf) {
+      LOG(eLevel::Error, "setTransport must be called before configure");
+      return;
+    }
+    transport = new_transport;
   }
 
   static size_t CurlAppendToRequest(char* buffer, size_t size, size_t nitems, void* userdata) {
@@ -322,21 +1520,64 @@ namespace MiniFireStore
     assert(r);
     size_t num_bytes = size * nitems;
     r->str_recv.append(buffer, num_bytes);
-    //log(eLevel::Trace, "[%p] Recv body of %ld bytes. New total %ld", r, num_bytes, r->str_recv.length());
-    //log(eLevel::Trace, "%s", r->str_recv.c_str());
+    //LOG(eLevel::Trace, "[%p] Recv body of %ld bytes. New total %ld", r, num_bytes, r->str_recv.length());
+    //LOG_PAYLOAD(eLevel::Trace, r->str_recv);
     return num_bytes;
   }
 
-  static size_t CurlReadFromRequest(char* buffer, size_t size, size_t nitems, void* userdata) {
+  // Reserve the recv buffer once when the server tells us the size of the body
+  // Returns the start of the value if it's the header key (lower case, with the colon), or nullptr
+  static const char* headerValue(const char* buffer, size_t num_bytes, const char* key, size_t key_len) {
+    if (num_bytes <= key_len)
+      return nullptr;
+    size_t i = 0;
+    while (i < key_len && (buffer[i] | 0x20) == key[i])
+      ++i;
+    if (i != key_len)
+      return nullptr;
+    const char* p = buffer + key_len;
+    const char* end = buffer + num_bytes;
+    while (p < end && *p == ' ')
+      ++p;
+    return p;
+  }
+
+  // Returns the number in the header line if it's the header key, or -1
+  static long long headerNumber(const char* buffer, size_t num_bytes, const char* key, size_t key_len) {
+    const char* p = headerValue(buffer, num_bytes, key, key_len);
+    const char* end = buffer + num_bytes;
+    if (!p || p == end || *p < '0' || *p > '9')
+      return -1;
+    long long value = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+      value = value * 10 + (*p++ - '0');
+    return value;
+  }
+
+  static size_t CurlHeaderFromRequest(char* buffer, size_t size, size_t nitems, void* userdata) {
     Request* r = (Request*)userdata;
     assert(r);
     size_t num_bytes = size * nitems;
-    size_t remaining_bytes = r->str_sent.length() - r->send_offset;
-    size_t bytes_to_send = std::min(num_bytes, remaining_bytes);
-    //log(eLevel::Trace, "[%p] Request body of %ld bytes from %ld -> %ld sent", r, num_bytes, r->send_offset, bytes_to_send);
-    memcpy(buffer, r->str_sent.data() + r->send_offset, bytes_to_send);
-    r->send_offset += bytes_to_send;
-    return bytes_to_send;
+    static const char content_length_key[] = "content-length:";
+    static const char content_encoding_key[] = "content-encoding:";
+    static const char retry_after_key[] = "retry-after:";
+    long long content_length = headerNumber(buffer, num_bytes, content_length_key, sizeof(content_length_key) - 1);
+    if (content_length >= 0)
+      r->content_length = content_length;
+    else if (headerValue(buffer, num_bytes, content_encoding_key, sizeof(content_encoding_key) - 1))
+      r->content_encoded = true;
+    // The empty line ends the headers. Content-Length is the size on the wire, and the compressed
+    // bodies are decoded to several times that size
+    if (num_bytes <= 2 && r->content_length > 0) {
+      long long expected_size = r->content_encoded ? r->content_length * Ctes::compressed_answer_ratio : r->content_length;
+      if (expected_size > (long long)r->str_recv.capacity() && expected_size <= (long long)Ctes::max_content_length_reserve)
+        r->str_recv.reserve((size_t)expected_size);
+    }
+    // Only the delay in seconds is supported, not the http dates
+    long long retry_after = headerNumber(buffer, num_bytes, retry_after_key, sizeof(retry_after_key) - 1);
+    if (retry_after >= 0)
+      r->retry_after_secs = (int)retry_after;
+    return num_bytes;
   }
 
   static CURL* CurlPrepareRequest(Request* r, curl_slist* chunk) {
@@ -349,7 +1590,7 @@ namespace MiniFireStore
         r->flags |= RPC_FLAG_TRACE;
     if (r->flags & RPC_FLAG_DELETE) {
       if (r->flags & RPC_FLAG_TRACE)
-        log(eLevel::Log, "Custom request delete");
+        LOG(eLevel::Log, "Custom request delete");
       curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
     }
 
@@ -361,83 +1602,340 @@ namespace MiniFireStore
       curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
 
     if (r->flags & RPC_FLAG_TRACE) {
-      log(eLevel::Log, "URL:%s", r->url.c_str());
+      LOG(eLevel::Log, "URL:%s", r->url.c_str());
       curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
     }
 
-    if (!r->str_sent.empty()) {
-      // Convert json to string
+    const std::string& payload = r->payload();
+    if (!payload.empty()) {
       if (r->flags & RPC_FLAG_TRACE)
-        log(eLevel::Log, "BODY:%s", r->str_sent.c_str());
-      curl_easy_setopt(curl, CURLOPT_READFUNCTION, &CurlReadFromRequest);
-      curl_easy_setopt(curl, CURLOPT_READDATA, r);
-      curl_easy_setopt(curl, CURLOPT_POST, 1L);
-      curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, r->str_sent.size());
+        LOG(eLevel::Log, "BODY:%s", r->body().c_str());
+      // curl reads the body directly from our buffer, which lives until the request completes.
+      // The size must be set before the data, or curl will use strlen
+      curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)payload.size());
+      curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload.data());
     }
 
+    // Empty string means all the encodings supported by the curl build
+    if (r->flags & RPC_FLAG_ACCEPT_ENCODING)
+      curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+
     if (r->flags & RPC_FLAG_GET) {
       curl_easy_setopt(curl, CURLOPT_POST, 0L);
     }
 
-    if (r->flags & RPC_FLAG_PATCH) {
-      curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PATCH");
+    // With HTTP/2 all the requests to a host share one connection, so the prewarm requests wait
+    // for the first one instead of opening connections that would stay idle. HTTP/1.1 opens one each
+    if (r->flags & RPC_FLAG_PREWARM)
+      curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+
+    if (r->flags & RPC_FLAG_PATCH) {
+      curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PATCH");
+    }
+
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &CurlAppendToRequest);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, r);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, &CurlHeaderFromRequest);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, r);
+
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, chunk);
+    return curl;
+  }
+
+  // ------------------------------------------------------------
+  bool gzipCompress(const std::string& input, std::string& output) {
+#ifdef MINI_FIRESTORE_ZLIB
+    z_stream zs = {};
+    // 15 + 16 => Max window with gzip header
+    if (deflateInit2(&zs, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      return false;
+    output.resize(deflateBound(&zs, (uLong)input.size()));
+    zs.next_in = (Bytef*)input.data();
+    zs.avail_in = (uInt)input.size();
+    zs.next_out = (Bytef*)&output[0];
+    zs.avail_out = (uInt)output.size();
+    int rc = deflate(&zs, Z_FINISH);
+    output.resize(zs.total_out);
+    deflateEnd(&zs);
+    return rc == Z_STREAM_END;
+#else
+    return false;
+#endif
+  }
+
+  // ------------------------------------------------------------
+  // Date algorithms from http://howardhinnant.github.io/date_algorithms.html
+  static int64_t daysFromCivil(int64_t y, int m, int d) {
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+  }
+
+  static void civilFromDays(int64_t days, int64_t& y, int& m, int& d) {
+    days += 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    int64_t doe = days - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * doy + 2) / 153;
+    d = (int)(doy - (153 * mp + 2) / 5 + 1);
+    m = (int)(mp < 10 ? mp + 3 : mp - 9);
+    y = yoe + era * 400 + (m <= 2);
+  }
+
+  static int daysInMonth(int64_t y, int m) {
+    static const int days[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    bool leap = (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+    return (m == 2 && leap) ? 29 : days[m - 1];
+  }
+
+  // Reads exactly n digits
+  static bool readDigits(const char*& p, const char* end, int n, int& out) {
+    if (end - p < n)
+      return false;
+    int value = 0;
+    for (int i = 0; i < n; ++i) {
+      unsigned digit = (unsigned)(p[i] - '0');
+      if (digit > 9)
+        return false;
+      value = value * 10 + (int)digit;
+    }
+    p += n;
+    out = value;
+    return true;
+  }
+
+  static bool readChar(const char*& p, const char* end, char c) {
+    if (p == end || *p != c)
+      return false;
+    ++p;
+    return true;
+  }
+
+  bool parseTimestamp(const char* str, size_t len, Timestamp* out) {
+    const char* p = str;
+    const char* end = str + len;
+    int year, month, day, hour, minute, second;
+    if (!readDigits(p, end, 4, year) || !readChar(p, end, '-')
+      || !readDigits(p, end, 2, month) || !readChar(p, end, '-')
+      || !readDigits(p, end, 2, day) || (!readChar(p, end, 'T') && !readChar(p, end, 't'))
+      || !readDigits(p, end, 2, hour) || !readChar(p, end, ':')
+      || !readDigits(p, end, 2, minute) || !readChar(p, end, ':')
+      || !readDigits(p, end, 2, second))
+      return false;
+    if (month < 1 || month > 12 || day < 1 || day > daysInMonth(year, month)
+      || hour > 23 || minute > 59 || second > 59)
+      return false;
+
+    // Fraction, extra digits beyond the nanoseconds are ignored
+    int32_t nanos = 0;
+    if (readChar(p, end, '.')) {
+      int ndigits = 0;
+      while (p != end && (unsigned)(*p - '0') <= 9) {
+        if (ndigits < 9) {
+          nanos = nanos * 10 + (*p - '0');
+          ++ndigits;
+        }
+        ++p;
+      }
+      if (ndigits == 0)
+        return false;
+      for (; ndigits < 9; ++ndigits)
+        nanos *= 10;
+    }
+
+    // Z or +hh:mm / -hh:mm
+    int offset_secs = 0;
+    if (p != end && (*p == '+' || *p == '-')) {
+      int sign = *p++ == '-' ? -1 : 1;
+      int off_hour, off_min;
+      if (!readDigits(p, end, 2, off_hour) || !readChar(p, end, ':') || !readDigits(p, end, 2, off_min)
+        || off_hour > 23 || off_min > 59)
+        return false;
+      offset_secs = sign * (off_hour * 3600 + off_min * 60);
+    }
+    else if (!readChar(p, end, 'Z') && !readChar(p, end, 'z')) {
+      return false;
+    }
+    if (p != end)
+      return false;
+
+    if (out) {
+      out->secs = daysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second - offset_secs;
+      out->nanos = nanos;
+    }
+    return true;
+  }
+
+  bool parseTimestamp(const std::string& str, Timestamp* out) {
+    return parseTimestamp(str.data(), str.size(), out);
+  }
+
+  static char* writeDigits(char* p, int64_t value, int n) {
+    for (int i = n - 1; i >= 0; --i) {
+      p[i] = (char)('0' + value % 10);
+      value /= 10;
+    }
+    return p + n;
+  }
+
+  std::string formatTimestamp(const Timestamp& ts) {
+    int64_t days = ts.secs / 86400;
+    int64_t rem = ts.secs % 86400;
+    if (rem < 0) {
+      rem += 86400;
+      --days;
     }
+    int64_t year;
+    int month, day;
+    civilFromDays(days, year, month, day);
+
+    char buf[sizeof "2011-10-08T07:07:09.123456789Z"];
+    char* p = buf;
+    p = writeDigits(p, year, 4);
+    *p++ = '-';
+    p = writeDigits(p, month, 2);
+    *p++ = '-';
+    p = writeDigits(p, day, 2);
+    *p++ = 'T';
+    p = writeDigits(p, rem / 3600, 2);
+    *p++ = ':';
+    p = writeDigits(p, (rem / 60) % 60, 2);
+    *p++ = ':';
+    p = writeDigits(p, rem % 60, 2);
+    if (ts.nanos) {
+      *p++ = '.';
+      if (ts.nanos % 1000000 == 0)
+        p = writeDigits(p, ts.nanos / 1000000, 3);
+      else if (ts.nanos % 1000 == 0)
+        p = writeDigits(p, ts.nanos / 1000, 6);
+      else
+        p = writeDigits(p, ts.nanos, 9);
+    }
+    *p++ = 'Z';
+    return std::string(buf, p - buf);
+  }
 
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &CurlAppendToRequest);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, r);
+  void to_json(json& j, const Timestamp& ts) {
+    j = formatTimestamp(ts);
+  }
 
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, chunk);
-    return curl;
+  void from_json(const json& j, Timestamp& ts) {
+    if (!j.is_string() || !parseTimestamp(j.get_ref< const std::string& >(), &ts))
+      ts = Timestamp();
   }
 
-  // ------------------------------------------------------------
   json timeToISO8601(time_t utc_time) {
-    char buf[sizeof "2011-10-08T07:07:09.000Z"];
-    struct tm tm_buf;
-    strftime(buf, sizeof buf, "%FT%TZ", gmtime_r(&utc_time, &tm_buf));
-    return buf;
+    return formatTimestamp(Timestamp(utc_time));
   }
 
   bool ISO8601ToTime(const json& j, time_t* out_time_t) {
     if (!j.is_string() || !out_time_t)
       return false;
-    std::string str = j.get< std::string >();
-    if (str.empty())
-      return false;
-
-    int msec = 0;   // Not currently used
-    struct tm tm = { 0 };
-    int n = sscanf(str.c_str(), "%04d-%02d-%02dT%02d:%02d:%02d.%dZ", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &msec);
-    tm.tm_year -= 1900;
-    tm.tm_mon -= 1;
-    if (n != 6)
+    Timestamp ts;
+    if (!parseTimestamp(j.get_ref< const std::string& >(), &ts))
       return false;
-    tm.tm_isdst = 0;
-    time_t time_stamp = mktime(&tm);
-
-    // Substract the timezone
-    struct tm tm_a;
-    struct tm tm_b;
-    time_t t0 = 1000000;
-    struct tm* gmt = gmtime_r(&t0, &tm_a);
-    struct tm* gml = localtime_r(&t0, &tm_b);
-    int delta = (gml->tm_hour - gmt->tm_hour);
-    time_stamp += delta * 3600;
-    *out_time_t = time_stamp;
+    *out_time_t = (time_t)ts.secs;
     return true;
   }
 
   // Does it look like a timestamp?
-  // 2022-04-15T14:25:30Z
+  // 2022-04-15T14:25:30Z, 2022-04-15T14:25:30.250Z, 2022-04-15T16:25:30+02:00
   bool isTimeISO8601(const std::string& str) {
-    if (str.length() >= 20) {
-      if (str[4] == '-' && str[7] == '-' && str[10] == 'T'
-        && str[13] == ':' && str[16] == ':' && str.back() == 'Z') {
-        // Check are all others are digits?
-        return true;
-      }
+    // Cheap rejection of most strings before the full parse
+    if (str.length() < 20 || str[4] != '-' || str[10] != 'T')
+      return false;
+    return parseTimestamp(str, nullptr);
+  }
+
+  // ------------------------------------------------------------
+  // Standard base64 with padding, as the bytesValue of the REST api
+  static const char base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  std::string base64Encode(const uint8_t* data, size_t size) {
+    std::string out;
+    out.resize((size + 2) / 3 * 4);
+    char* p = &out[0];
+    size_t i = 0;
+    for (; i + 3 <= size; i += 3) {
+      uint32_t v = ((uint32_t)data[i] << 16) | ((uint32_t)data[i + 1] << 8) | data[i + 2];
+      p[0] = base64_chars[v >> 18];
+      p[1] = base64_chars[(v >> 12) & 63];
+      p[2] = base64_chars[(v >> 6) & 63];
+      p[3] = base64_chars[v & 63];
+      p += 4;
     }
-    return false;
+    size_t rest = size - i;
+    if (rest) {
+      uint32_t v = (uint32_t)data[i] << 16;
+      if (rest == 2)
+        v |= (uint32_t)data[i + 1] << 8;
+      p[0] = base64_chars[v >> 18];
+      p[1] = base64_chars[(v >> 12) & 63];
+      p[2] = rest == 2 ? base64_chars[(v >> 6) & 63] : '=';
+      p[3] = '=';
+    }
+    return out;
+  }
+
+  // 0xff for the chars not in the alphabet. The url safe - and _ are also accepted
+  struct Base64DecodeTable {
+    uint8_t values[256];
+    Base64DecodeTable() {
+      memset(values, 0xff, sizeof(values));
+      for (int i = 0; i < 64; ++i)
+        values[(uint8_t)base64_chars[i]] = (uint8_t)i;
+      values[(uint8_t)'-'] = 62;
+      values[(uint8_t)'_'] = 63;
+    }
+  };
+
+  bool base64Decode(const char* str, size_t len, std::vector< uint8_t >& out) {
+    static const Base64DecodeTable table;
+    const uint8_t* in = (const uint8_t*)str;
+    // Padding is optional
+    while (len > 0 && in[len - 1] == '=')
+      --len;
+    if (len % 4 == 1)
+      return false;
+    out.resize(len / 4 * 3 + (len % 4 ? len % 4 - 1 : 0));
+    uint8_t* p = out.data();
+
+    // Invalid chars set the high bits of bad, checked once at the end
+    uint32_t bad = 0;
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4) {
+      uint32_t a = table.values[in[i]], b = table.values[in[i + 1]];
+      uint32_t c = table.values[in[i + 2]], d = table.values[in[i + 3]];
+      bad |= a | b | c | d;
+      uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+      p[0] = (uint8_t)(v >> 16);
+      p[1] = (uint8_t)(v >> 8);
+      p[2] = (uint8_t)v;
+      p += 3;
+    }
+    size_t rest = len - i;
+    if (rest) {
+      uint32_t a = table.values[in[i]], b = table.values[in[i + 1]];
+      uint32_t c = rest == 3 ? table.values[in[i + 2]] : 0;
+      bad |= a | b | c;
+      uint32_t v = (a << 18) | (b << 12) | (c << 6);
+      p[0] = (uint8_t)(v >> 16);
+      if (rest == 3)
+        p[1] = (uint8_t)(v >> 8);
+    }
+    if (bad & 0x80) {
+      out.clear();
+      return false;
+    }
+    return true;
+  }
+
+  bool base64Decode(const std::string& str, std::vector< uint8_t >& out) {
+    return base64Decode(str.data(), str.size(), out);
   }
 
   // ------------------------------------------------------------
@@ -451,11 +1949,6 @@ namespace MiniFireStore
     curl_global_cleanup();
   }
 
-  json fromFields(const json& j);
-  json fromValue(const json& j);
-  json asValue(const json& inValue);
-  json asDocument(const json& inDoc);
-
   json asValue(const json& inValue) {
     if (inValue.is_string()) {
       std::string str = inValue.get<std::string>();
@@ -478,15 +1971,22 @@ namespace MiniFireStore
     if (inValue.is_object()) {
       return { { "mapValue", asDocument(inValue) } };
     }
+    if (inValue.is_number_integer()) {
+      // int64 travels as a string. Unsigned values above the int64 range can only go as double
+      if (inValue.is_number_unsigned() && inValue.get<uint64_t>() > (uint64_t)INT64_MAX)
+        return { { "doubleValue", inValue.get<double>() } };
+      return { { "integerValue", std::to_string(inValue.get<int64_t>()) } };
+    }
     if (inValue.is_number()) {
       return { { "doubleValue", inValue } };
     }
     if (inValue.is_null()) {
       return { { "nullValue", nullptr } };
     }
-    // if( inValue....() ) {
-    //     return {{ "bytesValue", nullptr }};
-    // }
+    if (inValue.is_binary()) {
+      const json::binary_t& bytes = inValue.get_binary();
+      return { { "bytesValue", base64Encode(bytes.data(), bytes.size()) } };
+    }
     return json();
   }
 
@@ -506,6 +2006,34 @@ namespace MiniFireStore
     return outValue;
   }
 
+  // Decimal int64 as sent in integerValue. No allocations, false on bad chars or overflow
+  static bool parseInt64(const std::string& str, int64_t& out) {
+    const char* p = str.data();
+    const char* end = p + str.size();
+    bool negative = (p != end && *p == '-');
+    if (negative || (p != end && *p == '+'))
+      ++p;
+    if (p == end)
+      return false;
+    // Accumulate as a negative number, so INT64_MIN fits
+    int64_t value = 0;
+    for (; p != end; ++p) {
+      unsigned digit = (unsigned)(*p - '0');
+      if (digit > 9)
+        return false;
+      if (value < (INT64_MIN + (int64_t)digit) / 10)
+        return false;
+      value = value * 10 - (int64_t)digit;
+    }
+    if (!negative) {
+      if (value == INT64_MIN)
+        return false;
+      value = -value;
+    }
+    out = value;
+    return true;
+  }
+
   json fromValue(const json& j) {
     json outValue;
     if (j.contains("fields")) {
@@ -537,18 +2065,323 @@ namespace MiniFireStore
           outValue.push_back(fromValue(el));
       }
 
+    }
+    else if (j.contains("bytesValue")) {
+      const json& jbytes = j["bytesValue"];
+      json::binary_t bytes;
+      if (jbytes.is_string() && base64Decode(jbytes.get_ref< const std::string& >(), bytes))
+        return json::binary(std::move(bytes));
+      return nullptr;
+
     }
     else if (j.contains("doubleValue")) {
       return j["doubleValue"];
 
     }
     else if (j.contains("integerValue")) {
-      const std::string& integer_str = j["integerValue"].get<std::string>();
-      return atoi(integer_str.c_str());
+      const json& jint = j["integerValue"];
+      if (jint.is_string()) {
+        int64_t value = 0;
+        if (parseInt64(jint.get_ref< const std::string& >(), value))
+          return value;
+        return nullptr;
+      }
+      return jint;
     }
     return outValue;
   }
 
+  // ------------------------------------------------------------
+  void Future::State::receive(Result& r, int) {
+    resolve(r);
+  }
+
+  void Future::State::resolve(Result& r) {
+    if (ready)
+      return;
+    ready = true;
+    if (next) {
+      // The result moves along the chain, released as soon as it's delivered
+      std::shared_ptr< State > target = std::move(next);
+      target->receive(r, next_index);
+    }
+    else {
+      result = std::move(r);
+    }
+  }
+
+  void Future::State::chain(const std::shared_ptr< State >& new_next, int index) {
+    assert(!continued || !"Each future can be continued once");
+    continued = true;
+    if (ready) {
+      new_next->receive(result, index);
+      return;
+    }
+    next = new_next;
+    next_index = index;
+  }
+
+  Future Future::resolved(const Result& r) {
+    std::shared_ptr< State > state = std::make_shared< State >();
+    state->result = r;
+    state->ready = true;
+    return Future(state);
+  }
+
+  RequestCallback::RequestCallback(const Promise& promise) : future_state(promise.state) {}
+
+  void RequestCallback::operator()(Result& r) const {
+    if (future_state)
+      future_state->resolve(r);
+    else
+      callback(r);
+  }
+
+  Callback Promise::callback() const {
+    std::shared_ptr< Future::State > st = state;
+    return [st](Result& r) {
+      st->resolve(r);
+    };
+  }
+
+  struct WhenAllState : public Future::State {
+    json   items = json::value_t::array;
+    size_t pending = 0;
+    int    err = 0;
+    void receive(Result& r, int index) override {
+      items[index] = std::move(r.j);
+      if (r.err && !err)
+        err = r.err;
+      if (--pending == 0) {
+        Result all;
+        all.err = err;
+        all.j = std::move(items);
+        resolve(all);
+      }
+    }
+  };
+
+  Future when_all(const std::vector< Future >& futures) {
+    std::shared_ptr< WhenAllState > state = std::make_shared< WhenAllState >();
+    state->pending = futures.size();
+    if (futures.empty()) {
+      Result all;
+      all.err = 0;
+      all.j = json::value_t::array;
+      state->resolve(all);
+      return Future(state);
+    }
+    state->items.get_ref< json::array_t& >().resize(futures.size());
+    for (size_t i = 0; i < futures.size(); ++i)
+      futures[i].state->chain(state, (int)i);
+    return Future(state);
+  }
+
+  Future when_any(const std::vector< Future >& futures) {
+    // The default receive resolves with the first result, the rest are ignored
+    std::shared_ptr< Future::State > state = std::make_shared< Future::State >();
+    for (size_t i = 0; i < futures.size(); ++i)
+      futures[i].state->chain(state, (int)i);
+    return Future(state);
+  }
+
+  // ------------------------------------------------------------
+  namespace Schema {
+
+    void writeQuoted(std::string& out, const char* str, size_t len) {
+      static const char hex[] = "0123456789abcdef";
+      out += '"';
+      // Runs of chars not requiring escapes are appended at once
+      const char* run = str;
+      for (size_t i = 0; i < len; ++i) {
+        unsigned char c = (unsigned char)str[i];
+        if (c >= 0x20 && c != '"' && c != '\\')
+          continue;
+        out.append(run, str + i - run);
+        run = str + i + 1;
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default: {
+          char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+          out.append(esc, sizeof(esc));
+        }
+        }
+      }
+      out.append(run, str + len - run);
+      out += '"';
+    }
+
+    void writeBool(std::string& out, bool value) {
+      out += value ? "{\"booleanValue\":true}" : "{\"booleanValue\":false}";
+    }
+
+    void writeInteger(std::string& out, int64_t value) {
+      char buf[24];
+      char* end = buf + sizeof(buf);
+      char* p = end;
+      uint64_t u = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+      do {
+        *--p = (char)('0' + u % 10);
+        u /= 10;
+      } while (u);
+      if (value < 0)
+        *--p = '-';
+      out += "{\"integerValue\":\"";
+      out.append(p, end - p);
+      out += "\"}";
+    }
+
+    void writeUnsigned(std::string& out, uint64_t value) {
+      if (value > (uint64_t)INT64_MAX)
+        writeDouble(out, (double)value);
+      else
+        writeInteger(out, (int64_t)value);
+    }
+
+    void writeDouble(std::string& out, double value) {
+      out += "{\"doubleValue\":";
+      if (std::isnan(value)) {
+        out += "\"NaN\"";
+      }
+      else if (std::isinf(value)) {
+        out += value > 0 ? "\"Infinity\"" : "\"-Infinity\"";
+      }
+      else {
+        // Shortest representation that round trips, independent of the locale
+        char buf[64];
+        char* end = nlohmann::detail::to_chars(buf, buf + sizeof(buf), value);
+        out.append(buf, end - buf);
+      }
+      out += '}';
+    }
+
+    void writeString(std::string& out, const std::string& value) {
+      out += isTimeISO8601(value) ? "{\"timestampValue\":" : "{\"stringValue\":";
+      writeQuoted(out, value.data(), value.size());
+      out += '}';
+    }
+
+    void writeTimestamp(std::string& out, const Timestamp& value) {
+      std::string str = formatTimestamp(value);
+      out += "{\"timestampValue\":\"";
+      out += str;
+      out += "\"}";
+    }
+
+    void writeBytes(std::string& out, const json::binary_t& value) {
+      out += "{\"bytesValue\":\"";
+      out += base64Encode(value.data(), value.size());
+      out += "\"}";
+    }
+
+    void writeJson(std::string& out, const json& value) {
+      out += asValue(value).dump();
+    }
+
+    // Returns the member holding the value of the given type, or nullptr
+    static const json* valueOf(const json& v, const char* type) {
+      auto it = v.find(type);
+      return it != v.end() ? &*it : nullptr;
+    }
+
+    bool readBool(const json& v, bool& out) {
+      const json* jv = valueOf(v, "booleanValue");
+      if (!jv || !jv->is_boolean())
+        return false;
+      out = jv->get<bool>();
+      return true;
+    }
+
+    bool readInteger(const json& v, int64_t& out) {
+      if (const json* jv = valueOf(v, "integerValue")) {
+        if (jv->is_string())
+          return parseInt64(jv->get_ref< const std::string& >(), out);
+        if (!jv->is_number())
+          return false;
+        out = jv->get<int64_t>();
+        return true;
+      }
+      double d;
+      if (!readDouble(v, d) || d != d)
+        return false;
+      out = d >= 9223372036854775807.0 ? INT64_MAX : (d <= -9223372036854775808.0 ? INT64_MIN : (int64_t)d);
+      return true;
+    }
+
+    // Above INT64_MAX they arrive as doubleValue, see writeUnsigned
+    bool readUnsigned(const json& v, uint64_t& out) {
+      if (!v.contains("doubleValue")) {
+        int64_t i;
+        if (!readInteger(v, i))
+          return false;
+        out = (uint64_t)i;
+        return true;
+      }
+      double d;
+      if (!readDouble(v, d) || d != d)
+        return false;
+      out = d >= 18446744073709551615.0 ? UINT64_MAX : (d <= 0.0 ? 0 : (uint64_t)d);
+      return true;
+    }
+
+    bool readDouble(const json& v, double& out) {
+      if (const json* jv = valueOf(v, "doubleValue")) {
+        // NaN and Infinity arrive as strings
+        if (jv->is_string())
+          out = strtod(jv->get_ref< const std::string& >().c_str(), nullptr);
+        else if (jv->is_number())
+          out = jv->get<double>();
+        else
+          return false;
+        return true;
+      }
+      if (v.contains("integerValue")) {
+        int64_t i;
+        if (!readInteger(v, i))
+          return false;
+        out = (double)i;
+        return true;
+      }
+      return false;
+    }
+
+    bool readString(const json& v, std::string& out) {
+      const json* jv = valueOf(v, "stringValue");
+      if (!jv)
+        jv = valueOf(v, "timestampValue");
+      if (!jv || !jv->is_string())
+        return false;
+      out = jv->get_ref< const std::string& >();
+      return true;
+    }
+
+    bool readTimestamp(const json& v, Timestamp& out) {
+      const json* jv = valueOf(v, "timestampValue");
+      if (!jv)
+        jv = valueOf(v, "stringValue");
+      return jv && jv->is_string() && parseTimestamp(jv->get_ref< const std::string& >(), &out);
+    }
+
+    bool readBytes(const json& v, json::binary_t& out) {
+      const json* jv = valueOf(v, "bytesValue");
+      return jv && jv->is_string() && base64Decode(jv->get_ref< const std::string& >(), out);
+    }
+
+    const json* mapFields(const json& v) {
+      const json* jmap = valueOf(v, "mapValue");
+      return jmap ? valueOf(*jmap, "fields") : nullptr;
+    }
+
+    const json* arrayValues(const json& v) {
+      const json* jarray = valueOf(v, "arrayValue");
+      return jarray ? valueOf(*jarray, "values") : nullptr;
+    }
+  }
+
   static bool isCollection(const std::string& url) {
     size_t n = 0;
     const char* p = url.data();
@@ -581,13 +2414,35 @@ namespace MiniFireStore
 
   void Firestore::configure(const char* new_project_id, const char* new_api_key) {
     project_id = new_project_id;
-    url_root = Ctes::api_firestore_url;
+    api_key = new_api_key;
+    setupUrls();
+    if (!otf)
+      otf = new OTFRequests(this, transport ? transport->impl : nullptr);
+  }
+
+  void Firestore::useEmulator(const std::string& host) {
+    emulator_host = host;
+    setupUrls();
+  }
+
+  void Firestore::setupUrls() {
+    if (emulator_host.empty())
+      url_root = Ctes::api_firestore_url;
+    else
+      url_root = "http://" + emulator_host + Ctes::emulator_firestore_path;
     url_root.append(project_id);
     url_root.append("/databases/(default)/documents");
     doc_root = "projects/" + project_id + "/databases/(default)/documents/";
-    api_key = new_api_key;
-    if (!otf)
-      otf = new OTFRequests();
+  }
+
+  // The emulator serves the auth services keeping the original host name in the path,
+  // like the firebase emulators do: http://emulator_host/identitytoolkit.googleapis.com/...
+  std::string Firestore::serviceUrl(const char* url) const {
+    if (emulator_host.empty())
+      return url;
+    const char* host = strstr(url, "://");
+    assert(host);
+    return "http://" + emulator_host + "/" + (host + 3);
   }
 
   void Firestore::disconnect() {
@@ -595,6 +2450,7 @@ namespace MiniFireStore
       delete otf;
     otf = nullptr;
     token.clear();
+    refresh_token.clear();
     user_id.clear();
   }
 
@@ -607,9 +2463,9 @@ namespace MiniFireStore
   }
 
   void Firestore::connectOrSignUp(const std::string& email, const std::string& password, Callback cb) {
-    connect(email, password, [=](Result& r) {
+    connect(email, password, [this, email, password, cb](Result& r) {
       if (r.err == ERR_AUTH_EMAIL_NOT_FOUND) {
-        log(eLevel::Log, "Email not found. Signing up");
+        LOG(eLevel::Log, "Email not found. Signing up");
         signUp(email, password, cb);
         return;
       }
@@ -620,7 +2476,7 @@ namespace MiniFireStore
   void Firestore::authRequest(const char* url_base, const std::string& email, const std::string& password, Callback cb) {
     assert(otf);
 
-    std::string url = url_base;
+    std::string url = serviceUrl(url_base);
     url.append("?key=");
     url.append(api_key);
 
@@ -630,12 +2486,11 @@ namespace MiniFireStore
         {"returnSecureToken", true}
     };
 
-    auto pre_cb = [=](Result& result) {
+    auto pre_cb = [this](Result& result, RequestCallback& cb) {
       if (!result.err) {
         user_id = result.j.value("localId", "");
-        std::string new_token = result.j.value("idToken", "");
-        log(eLevel::Log, "Local UID: %s", user_id.c_str());
-        setToken(new_token);
+        LOG(eLevel::Log, "Local UID: %s", user_id.c_str());
+        setToken(result.j.value("idToken", ""), result.j.value("refreshToken", ""), atoi(result.j.value("expiresIn", "3600").c_str()));
       }
       else {
         if (result.j.contains("error")) {
@@ -645,15 +2500,67 @@ namespace MiniFireStore
       cb(result);
     };
 
-    allocRequest(url, j, pre_cb, "connect", RPC_FLAG_CONNECT);
+    allocRequest(url, j, withCallback(std::move(cb), pre_cb), "connect", RPC_FLAG_CONNECT);
   }
 
-  void Firestore::setToken(const std::string& new_token) {
-    log(eLevel::Log, "Token: %s", new_token.c_str());
+  void Firestore::setToken(const std::string& new_token, const std::string& new_refresh_token, int expires_in_secs) {
+    LOG(eLevel::Log, "Token: %s (expires in %d secs)", new_token.c_str(), expires_in_secs);
     token = new_token;
+    if (!new_refresh_token.empty())
+      refresh_token = new_refresh_token;
+    // Short lived tokens would be about to expire as soon as they are received
+    int margin_secs = std::min(Ctes::token_refresh_margin_secs, expires_in_secs / 2);
+    token_refresh_time = std::chrono::steady_clock::now() + std::chrono::seconds(expires_in_secs - margin_secs);
     otf->setToken(new_token);
   }
 
+  void Firestore::checkTokenExpiration() {
+    if (refresh_token.empty() || otf->refreshing_token)
+      return;
+    if (std::chrono::steady_clock::now() < token_refresh_time)
+      return;
+    LOG(eLevel::Log, "Token is about to expire");
+    refreshToken();
+  }
+
+  void Firestore::refreshToken() {
+    assert(otf);
+    if (otf->refreshing_token)
+      return;
+
+    if (refresh_token.empty()) {
+      LOG(eLevel::Error, "Can't refresh the token. No refresh token available");
+      otf->releaseHeldRequests(false);
+      return;
+    }
+
+    std::string url = serviceUrl(Ctes::api_refresh_token_host);
+    url.append("?key=");
+    url.append(api_key);
+
+    json j = {
+        {"grantType", "refresh_token"},
+        {"refreshToken", refresh_token}
+    };
+
+    auto pre_cb = [this](Result& result) {
+      if (!result.err) {
+        LOG(eLevel::Log, "Token refreshed");
+        setToken(result.j.value("id_token", ""), result.j.value("refresh_token", ""), atoi(result.j.value("expires_in", "3600").c_str()));
+        otf->releaseHeldRequests(true);
+      }
+      else {
+        LOG(eLevel::Error, "Token refresh failed: %s", result.str.c_str());
+        // Don't try again immediately
+        token_refresh_time = std::chrono::steady_clock::now() + std::chrono::seconds(Ctes::token_refresh_retry_secs);
+        otf->releaseHeldRequests(false);
+      }
+    };
+
+    otf->holdRequests();
+    allocRequest(url, j, pre_cb, "refresh", RPC_FLAG_CONNECT);
+  }
+
   Ref Firestore::ref(const std::string& path) {
     return Ref(this, path);
   }
@@ -668,17 +2575,55 @@ namespace MiniFireStore
   }
 
   // --------------------------------------------------------------------------------
-  uint32_t Ref::read(Callback cb) const
+  uint32_t Ref::read(RequestCallback cb) const {
+    return readDoc(std::move(cb), nullptr);
+  }
+
+  Future Ref::read() const { Promise p; read(RequestCallback(p)); return p.future(); }
+  Future Ref::readFields() const { Promise p; readFields(RequestCallback(p)); return p.future(); }
+  Future Ref::write(const json& j) const { Promise p; write(j, RequestCallback(p)); return p.future(); }
+  Future Ref::del() const { Promise p; del(RequestCallback(p)); return p.future(); }
+  Future Ref::add(const json& j) const { Promise p; add(j, RequestCallback(p)); return p.future(); }
+  Future Ref::query(const Query& q) const { Promise p; query(q, RequestCallback(p)); return p.future(); }
+  Future Ref::inc(const std::string& field_name, double value) const { Promise p; inc(field_name, value, RequestCallback(p)); return p.future(); }
+  Future Ref::list(int page_size, const char* next_token) const { Promise p; list(RequestCallback(p), page_size, next_token); return p.future(); }
+#if !MINI_FIRESTORE_COROUTINES
+  Future Ref::listAll() const { Promise p; listAll(RequestCallback(p)); return p.future(); }
+#endif
+  Future Ref::patch(const std::string& field_name, const json& new_value) const { Promise p; patch(field_name, new_value, RequestCallback(p)); return p.future(); }
+  Future Ref::update(const UpdateSpec& spec) const { Promise p; update(spec, RequestCallback(p)); return p.future(); }
+  Future Ref::writeIf(const json& j, const std::string& update_time) const { Promise p; writeIf(j, update_time, RequestCallback(p)); return p.future(); }
+  Future Ref::create(const json& j) const { Promise p; create(j, RequestCallback(p)); return p.future(); }
+  Future Ref::updateIfExists(const json& j) const { Promise p; updateIfExists(j, RequestCallback(p)); return p.future(); }
+  Future Ref::commit(const SharedBody& body) const { Promise p; commit(body, RequestCallback(p)); return p.future(); }
+
+  uint32_t Ref::readFields(RequestCallback cb) const {
+    return readDoc(std::move(cb), nullptr, true);
+  }
+
+  uint32_t Ref::readDoc(RequestCallback cb, const std::string* transaction_id, bool keep_fields) const
   {
     json jbody = { {"documents", { db->doc_root + doc_id }} };
+    if (transaction_id)
+      jbody["transaction"] = *transaction_id;
 
-    auto pre_cb = [=](Result& result) {
+    auto pre_cb = [keep_fields](Result& result, RequestCallback& cb) {
       if (!result.err) {
         assert(result.j.is_array());
-        const json j0 = std::move(result.j[0]);
-
-        if (j0.contains("found")) {
-          result.j = fromValue(j0["found"]);
+        json j0 = std::move(result.j[0]);
+
+        auto found = j0.find("found");
+        if (found != j0.end()) {
+          json& jdoc = *found;
+          result.update_time = jdoc.value("updateTime", "");
+          if (keep_fields) {
+            auto fields = jdoc.find("fields");
+            result.fields = (fields != jdoc.end()) ? std::move(*fields) : json(json::value_t::object);
+            result.j = json::value_t::object;
+          }
+          else {
+            result.j = fromValue(jdoc);
+          }
         }
         else if (j0.contains("missing")) {
           result.err = ERR_DOC_MISSING;
@@ -688,21 +2633,22 @@ namespace MiniFireStore
       cb(result);
     };
 
-    return db->allocRequest(":batchGet", jbody, pre_cb, "read", 0);
+    return db->allocRequest(":batchGet", jbody, withCallback(std::move(cb), pre_cb), "read", 0);
   }
 
-  uint32_t Ref::del(Callback cb) const {
+  uint32_t Ref::del(RequestCallback cb) const {
 
     if (isCollection(doc_id)) {
-      log(eLevel::Trace, "Deleting collection at %s. Requires scanning subdocs", doc_id.c_str());
+      LOG(eLevel::Trace, "Deleting collection at %s. Requires scanning subdocs", doc_id.c_str());
 
       // This might not work if the number of docs in the collection is superlarge
       Ref rbase = *this;
       uint32_t id = listAll([=](Result& res) {
         const json& jdocs = res.j["documents"];
         if (jdocs.is_null() || jdocs.empty()) {
-          log(eLevel::Trace, "  No subdocs in the collection");
+          LOG(eLevel::Trace, "  No subdocs in the collection");
           Result result;
+          result.err = 0;
           cb(result);
         }
         else {
@@ -715,9 +2661,10 @@ namespace MiniFireStore
           auto dec = [cb, value] {  
             *value = *value - 1;
             if (*value == 0) {
-              log(eLevel::Trace, "  Last subdoc removed. Triggering the callback");
+              LOG(eLevel::Trace, "  Last subdoc removed. Triggering the callback");
               delete value;
               Result result;
+              result.err = 0;
               cb(result);
             }
           };
@@ -726,7 +2673,7 @@ namespace MiniFireStore
           };
 
           // Alloc a pointer to store the remaining callbacks to complete this request
-          log(eLevel::Trace, "  %d subdocs in the collection", (int)jdocs.size());
+          LOG(eLevel::Trace, "  %d subdocs in the collection", (int)jdocs.size());
           for (const auto& j : jdocs) {
             if (j.contains("name")) {
               std::string uri = j["name"];
@@ -743,30 +2690,90 @@ namespace MiniFireStore
       });
       return id;
     }
-    return db->allocRequest(doc_id, nullptr, cb, "del", RPC_FLAG_DELETE);
+    return db->allocRequest(doc_id, nullptr, std::move(cb), "del", RPC_FLAG_DELETE | RPC_FLAG_WRITE, SharedBody(), doc_id);
   }
 
-  uint32_t Ref::add(const json& j, Callback cb) const {
-    auto pre_cb = [=](Result& result) {
+  uint32_t Ref::add(const json& j, RequestCallback cb) const {
+    auto pre_cb = [](Result& result, RequestCallback& cb) {
       if (!result.err) {
         assert(result.j.contains("name"));
         result.added_id = idFromPath(result.j["name"]);
       }
       cb(result);
     };
-    return db->allocRequest(doc_id, asDocument(j), pre_cb, "add");
+    return db->allocRequest(doc_id, asDocument(j), withCallback(std::move(cb), pre_cb), "add", RPC_FLAG_WRITE, SharedBody(), doc_id);
   }
 
-  uint32_t Ref::write(const json& j, Callback cb) const {
+  json Ref::updateWrite(const json& j) const {
     json jDocument = asDocument(j);
     jDocument["name"] = db->doc_root + doc_id;
-    json jCmd = {
-        { "writes", {{"update", jDocument }} }
+    return { {"update", jDocument } };
+  }
+
+  json Ref::writeCommand(const json& j, const json& precondition) const {
+    json jwrite = updateWrite(j);
+    if (!precondition.is_null())
+      jwrite["currentDocument"] = precondition;
+    return {
+        { "writes", jwrite }
     };
-    return db->allocRequest(":commit", jCmd, cb, "write");
   }
 
-  uint32_t Ref::inc(const std::string& field_name, double value, Callback cb) const {
+  uint32_t Ref::writeIf(const json& j, const std::string& update_time, RequestCallback cb) const {
+    return db->allocRequest(":commit", writeCommand(j, { {"updateTime", update_time} }), std::move(cb), "writeIf", RPC_FLAG_WRITE, SharedBody(), doc_id);
+  }
+
+  uint32_t Ref::create(const json& j, RequestCallback cb) const {
+    return db->allocRequest(":commit", writeCommand(j, { {"exists", false} }), std::move(cb), "create", RPC_FLAG_WRITE, SharedBody(), doc_id);
+  }
+
+  uint32_t Ref::updateIfExists(const json& j, RequestCallback cb) const {
+    return db->allocRequest(":commit", writeCommand(j, { {"exists", true} }), std::move(cb), "updateIfExists", RPC_FLAG_WRITE, SharedBody(), doc_id);
+  }
+
+  uint32_t Ref::write(const json& j, RequestCallback cb) const {
+    return db->allocRequest(":commit", writeCommand(j), std::move(cb), "write", RPC_FLAG_WRITE, SharedBody(), doc_id);
+  }
+
+  SharedBody Ref::prepareWrite(const json& j) const {
+    return makeBody(writeCommand(j).dump());
+  }
+
+  SharedBody Ref::makeBody(std::string&& text) const {
+    std::shared_ptr< PreparedBody > body = std::make_shared< PreparedBody >();
+    body->text = std::move(text);
+    if (db->gzip_requests_min_size && body->text.size() >= db->gzip_requests_min_size) {
+      if (!gzipCompress(body->text, body->gzip))
+        body->gzip.clear();
+    }
+    return body;
+  }
+
+  uint32_t Ref::commit(const SharedBody& body, RequestCallback cb) const {
+    return sendWrite(body, std::move(cb), "commit");
+  }
+
+  uint32_t Ref::sendWrite(const SharedBody& body, RequestCallback cb, const char* label) const {
+    assert(body);
+    return db->allocRequest(":commit", nullptr, std::move(cb), label, RPC_FLAG_WRITE, body, doc_id);
+  }
+
+  // The body of write up to the fields, as writeCommand(j).dump() would generate it
+  void Ref::beginWriteBody(std::string& body) const {
+    std::string name = db->doc_root + doc_id;
+    body += "{\"writes\":{\"update\":{\"name\":";
+    Schema::writeQuoted(body, name.data(), name.size());
+    body += ",\"fields\":";
+  }
+
+  // Integral increments keep integer counters as integers
+  static json incrementValue(double value) {
+    if (value == std::floor(value) && std::fabs(value) < 9007199254740992.0)
+      return { {"integerValue", std::to_string((int64_t)value) } };
+    return { {"doubleValue", value } };
+  }
+
+  uint32_t Ref::inc(const std::string& field_name, double value, RequestCallback cb) const {
     json jCmd = {
         { "writes", {
             {
@@ -776,9 +2783,7 @@ namespace MiniFireStore
                         {"fieldTransforms", {
                             {
                                 { "fieldPath", field_name },
-                                { "increment",
-                                    { {"doubleValue", value } }
-                                }
+                                { "increment", incrementValue(value) }
                             }
                         }}
                     }
@@ -786,7 +2791,7 @@ namespace MiniFireStore
             },
         }}
     };
-    auto pre_cb = [=](Result& result) {
+    auto pre_cb = [](Result& result, RequestCallback& cb) {
       // Transform the result into something more easy to parse for the end-user
       if (!result.err) {
         // Just tripple check each blind access
@@ -800,42 +2805,71 @@ namespace MiniFireStore
       }
       cb(result);
     };
-    return db->allocRequest(":commit", jCmd, pre_cb, "inc");
+    return db->allocRequest(":commit", jCmd, withCallback(std::move(cb), pre_cb), "inc", RPC_FLAG_WRITE, SharedBody(), doc_id);
   }
 
-  uint32_t Ref::list(Callback cb, int page_size, const char* next_token) const {
+  uint32_t Ref::list(RequestCallback cb, int page_size, const char* next_token) const {
     std::string url = doc_id;
     if (page_size != 0)
       url += "?pageSize=" + std::to_string(page_size);
     if (next_token)
       url += "?pageToken=" + std::string(next_token);
-    return db->allocRequest(url, nullptr, cb, "list", RPC_FLAG_GET);
+    return db->allocRequest(url, nullptr, std::move(cb), "list", RPC_FLAG_GET);
   }
 
-  uint32_t Ref::listAll(Callback cb) const {
+#if MINI_FIRESTORE_COROUTINES
+  // The pages are requested one after the other, and their docs are appended to the first result
+  static Task listAllPages(Ref ref) {
+    Result all = co_await ref.list();
+    std::string next_token = all.j.value("nextPageToken", "");
+    while (!all.err && !next_token.empty()) {
+      Result page = co_await ref.list(0, next_token.c_str());
+      if (page.err) {
+        all = std::move(page);
+        break;
+      }
+      json& final_docs = all.j["documents"];
+      for (json& j : page.j["documents"])
+        final_docs.push_back(std::move(j));
+      next_token = page.j.value("nextPageToken", "");
+    }
+    co_return all;
+  }
+
+  Future Ref::listAll() const {
+    return listAllPages(*this);
+  }
+
+  uint32_t Ref::listAll(RequestCallback cb) const {
+    listAll().then([cb = std::move(cb)](Result& r) { cb(r); });
+    return 0;
+  }
+
+#else
+  uint32_t Ref::listAll(RequestCallback cb) const {
 
     // The full operation requires a struct to hold the progress
     // So, allocate a struct and pass it by value between callbacks
     struct State {
-      Ref         ref;
-      Callback    cb;
-      std::string next_token;
-      Result      result;
+      Ref             ref;
+      RequestCallback cb;
+      std::string     next_token;
+      Result          result;
       std::function<void(State* s)> listBatch;
     };
     State* s = new State{ *this, cb };
-    log(eLevel::Trace, "[%p] Alloc", s);
+    LOG(eLevel::Trace, "[%p] Alloc", s);
 
     s->listBatch = [=](State* s) {
       s->ref.list([=](Result& result) {
 
         const json& jdocs = result.j["documents"];
         if (s->next_token.empty()) {
-          log(eLevel::Trace, "[%p] Saving initial result of %d docs", s, (int)jdocs.size());
+          LOG(eLevel::Trace, "[%p] Saving initial result of %d docs", s, (int)jdocs.size());
           s->result = result;
         }
         else {
-          log(eLevel::Trace, "[%p] Adding %d result to existing result", s, (int)jdocs.size());
+          LOG(eLevel::Trace, "[%p] Adding %d result to existing result", s, (int)jdocs.size());
           json& final_docs = s->result.j["documents"];
           for (auto& j : jdocs) 
             final_docs.push_back(j);
@@ -843,12 +2877,12 @@ namespace MiniFireStore
 
         // Check if there are more results in the db
         if (result.j.contains("nextPageToken")) {
-          log(eLevel::Trace, "[%p] There are more pages!", s);
+          LOG(eLevel::Trace, "[%p] There are more pages!", s);
           s->next_token = result.j["nextPageToken"];
           s->listBatch(s);
         }
         else {
-          log(eLevel::Trace, "[%p] We have all the results. Calling the original callback", s);
+          LOG(eLevel::Trace, "[%p] We have all the results. Calling the original callback", s);
           s->cb(s->result);
           delete s;
         }
@@ -861,11 +2895,146 @@ namespace MiniFireStore
 
     return 0;
   }
+#endif
+
+  // -----------------------------------------
+  // Segments which are not simple identifiers must be quoted with backticks
+  static std::string quoteFieldPath(const std::string& dotted_path) {
+    std::string out;
+    size_t start = 0;
+    while (start <= dotted_path.size()) {
+      size_t end = dotted_path.find('.', start);
+      if (end == std::string::npos)
+        end = dotted_path.size();
+      std::string seg = dotted_path.substr(start, end - start);
+      bool simple = !seg.empty() && !isdigit((unsigned char)seg[0]);
+      for (char c : seg)
+        simple &= (isalnum((unsigned char)c) || c == '_');
+      if (!out.empty())
+        out.push_back('.');
+      if (simple) {
+        out.append(seg);
+      }
+      else {
+        out.push_back('`');
+        for (char c : seg) {
+          if (c == '`' || c == '\\')
+            out.push_back('\\');
+          out.push_back(c);
+        }
+        out.push_back('`');
+      }
+      start = end + 1;
+    }
+    return out;
+  }
+
+  UpdateSpec& UpdateSpec::set(const std::string& field_path, const json& value) {
+    // Build the nested objects of the path
+    json* node = &fields;
+    size_t start = 0;
+    size_t end;
+    while ((end = field_path.find('.', start)) != std::string::npos) {
+      json& child = (*node)[field_path.substr(start, end - start)];
+      if (!child.is_object())
+        child = json::value_t::object;
+      node = &child;
+      start = end + 1;
+    }
+    (*node)[field_path.substr(start)] = value;
+    field_paths.push_back(field_path);
+    return *this;
+  }
+
+  // A path in the mask without a value in the fields is deleted
+  UpdateSpec& UpdateSpec::remove(const std::string& field_path) {
+    field_paths.push_back(field_path);
+    return *this;
+  }
+
+  UpdateSpec& UpdateSpec::increment(const std::string& field_path, const json& value) {
+    transforms.push_back({ field_path, "increment", value });
+    return *this;
+  }
+
+  UpdateSpec& UpdateSpec::maximum(const std::string& field_path, const json& value) {
+    transforms.push_back({ field_path, "maximum", value });
+    return *this;
+  }
+
+  UpdateSpec& UpdateSpec::minimum(const std::string& field_path, const json& value) {
+    transforms.push_back({ field_path, "minimum", value });
+    return *this;
+  }
+
+  UpdateSpec& UpdateSpec::serverTimestamp(const std::string& field_path) {
+    transforms.push_back({ field_path, "setToServerValue", "REQUEST_TIME" });
+    return *this;
+  }
+
+  // The operands of the array transforms are ArrayValues, so a single value is sent as an array of one
+  UpdateSpec& UpdateSpec::arrayUnion(const std::string& field_path, const json& values) {
+    transforms.push_back({ field_path, "appendMissingElements", values.is_array() ? values : json::array({ values }) });
+    return *this;
+  }
+
+  UpdateSpec& UpdateSpec::arrayRemove(const std::string& field_path, const json& values) {
+    transforms.push_back({ field_path, "removeAllFromArray", values.is_array() ? values : json::array({ values }) });
+    return *this;
+  }
+
+  uint32_t Ref::update(const UpdateSpec& spec, RequestCallback cb) const {
+    json jwrite = updateWrite(spec.fields);
+
+    json mask = json::value_t::array;
+    for (auto& path : spec.field_paths)
+      mask.push_back(quoteFieldPath(path));
+    jwrite["updateMask"] = { {"fieldPaths", mask} };
+
+    if (!spec.transforms.empty()) {
+      json jtransforms = json::value_t::array;
+      for (auto& t : spec.transforms) {
+        json jvalue;
+        if (strcmp(t.op, "setToServerValue") == 0)
+          jvalue = t.value;
+        else if (t.value.is_array())
+          jvalue = asValue(t.value)["arrayValue"];
+        else
+          jvalue = asValue(t.value);
+        jtransforms.push_back({ {"fieldPath", quoteFieldPath(t.field_path)}, {t.op, jvalue} });
+      }
+      jwrite["updateTransforms"] = jtransforms;
+    }
+
+    if (spec.must_exist)
+      jwrite["currentDocument"] = { {"exists", true} };
+
+    // The transform results come in the same order as the transforms
+    std::vector< std::string > transformed;
+    for (auto& t : spec.transforms)
+      transformed.push_back(t.field_path);
+
+    auto pre_cb = [transformed](Result& result, RequestCallback& cb) {
+      if (!result.err) {
+        json values = json::value_t::object;
+        const json& jwr = result.j["writeResults"][0];
+        if (jwr.contains("transformResults")) {
+          const json& jresults = jwr["transformResults"];
+          for (size_t i = 0; i < transformed.size() && i < jresults.size(); ++i)
+            values[transformed[i]] = fromValue(jresults[i]);
+        }
+        result.j = std::move(values);
+      }
+      cb(result);
+    };
+
+    return db->allocRequest(":commit", { {"writes", jwrite} }, withCallback(std::move(cb), pre_cb), "update", RPC_FLAG_WRITE, SharedBody(), doc_id);
+  }
 
-  uint32_t Ref::patch(const std::string& field_name, const json& new_value, Callback cb) const {
+  uint32_t Ref::patch(const std::string& field_name, const json& new_value, RequestCallback cb) const {
     std::string url = doc_id + "?updateMask.fieldPaths=" + field_name + "&mask.fieldPaths=" + field_name;
     json j = { { field_name, new_value } };
-    return db->allocRequest(url, asDocument(j), cb, "patch", RPC_FLAG_PATCH);
+    return db->allocRequest(url, asDocument(j), std::move(cb), "patch", RPC_FLAG_PATCH | RPC_FLAG_WRITE, SharedBody(), doc_id);
   }
 
   // Helpers to convert a OrderBy/Condition to json
@@ -890,7 +3059,7 @@ namespace MiniFireStore
     } };
   }
 
-  uint32_t Ref::query(const Query& query, Callback cb) const {
+  uint32_t Ref::query(const Query& query, RequestCallback cb) const {
 
     std::string parent, collection_id;
     splitParentAndId(doc_id, parent, collection_id);
@@ -922,10 +3091,11 @@ namespace MiniFireStore
     if (query.limit > 0)
       sq["limit"] = query.limit;
 
-    auto pre_cb = [=](Result& result) {
+    auto pre_cb = [](Result& result, RequestCallback& cb) {
       if (!result.err && result.j.is_array() && result.j.size() >= 0) {
         const json j = std::move(result.j);
         result.j = json::value_t::array;
+        result.update_times.clear();
         for (auto& el : j) {
           if (el.contains("document")) {
             const json& jdoc = el["document"];
@@ -933,13 +3103,14 @@ namespace MiniFireStore
             
             // The doc_id is stored in a member 
             result.j.back()[Ctes::json_doc_id_key] = idFromPath(jdoc["name"]);
+            result.update_times.push_back(jdoc.value("updateTime", ""));
           }
         }
       }
       cb(result);
     };
 
-    return db->allocRequest(parent + ":runQuery", jq, pre_cb, "query");
+    return db->allocRequest(parent + ":runQuery", jq, withCallback(std::move(cb), pre_cb), "query");
   }
 
   const std::string& Result::getDocKeyName() {
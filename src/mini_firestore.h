@@ -1,10 +1,29 @@
 #pragma once
 
+#include <cassert>
 #include <string>
 #include <functional>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <cstddef>
+#include <new>
+#include <type_traits>
 
 #include <nlohmann/json.hpp>
 
+// co_await support when building as C++20 with coroutines
+#if !defined(MINI_FIRESTORE_COROUTINES) && defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define MINI_FIRESTORE_COROUTINES 1
+#endif
+#endif
+#if MINI_FIRESTORE_COROUTINES
+#include <coroutine>
+#include <exception>
+#endif
+
 struct curl_slist;
 
 namespace MiniFireStore
@@ -14,9 +33,124 @@ namespace MiniFireStore
 
   struct Result;
   class Firestore;
+  class Transaction;
+  class Future;
   using Callback = std::function<void(Result& j)>;
 
+  // Move only callable with inline storage, holding the callbacks of the requests on the fly. The
+  // user callback plus the captures of the library fit inline, so they don't allocate
+  class InlineCallback {
+  public:
+    static const size_t inline_size = 96;
+
+    InlineCallback() = default;
+    InlineCallback(std::nullptr_t) {}
+    template< typename Fn, typename = typename std::enable_if< !std::is_same< typename std::decay< Fn >::type, InlineCallback >::value >::type >
+    InlineCallback(Fn&& fn) {
+      using F = typename std::decay< Fn >::type;
+      construct< F >(std::forward< Fn >(fn), std::integral_constant< bool, fitsInline< F >() >());
+    }
+    InlineCallback(InlineCallback&& other) noexcept { moveFrom(other); }
+    InlineCallback& operator=(InlineCallback&& other) noexcept {
+      if (this != &other) {
+        reset();
+        moveFrom(other);
+      }
+      return *this;
+    }
+    InlineCallback(const InlineCallback&) = delete;
+    InlineCallback& operator=(const InlineCallback&) = delete;
+    ~InlineCallback() { reset(); }
+
+    void reset() {
+      if (ops) {
+        ops->destroy(buffer);
+        ops = nullptr;
+      }
+    }
+    explicit operator bool() const { return ops != nullptr; }
+    void operator()(Result& r) { ops->invoke(buffer, r); }
+
+  private:
+    struct Ops {
+      void (*invoke)(void* buf, Result& r);
+      void (*move)(void* dst, void* src);         // Also destroys src
+      void (*destroy)(void* buf);
+    };
+
+    template< typename F >
+    static constexpr bool fitsInline() {
+      return sizeof(F) <= inline_size && alignof(F) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible< F >::value;
+    }
+
+    template< typename F >
+    struct InlineOps {
+      static void invoke(void* buf, Result& r) { (*static_cast< F* >(buf))(r); }
+      static void move(void* dst, void* src) {
+        new (dst) F(std::move(*static_cast< F* >(src)));
+        static_cast< F* >(src)->~F();
+      }
+      static void destroy(void* buf) { static_cast< F* >(buf)->~F(); }
+      static const Ops ops;
+    };
+
+    // Too large, the buffer holds a pointer
+    template< typename F >
+    struct HeapOps {
+      static void invoke(void* buf, Result& r) { (**static_cast< F** >(buf))(r); }
+      static void move(void* dst, void* src) { *static_cast< F** >(dst) = *static_cast< F** >(src); }
+      static void destroy(void* buf) { delete *static_cast< F** >(buf); }
+      static const Ops ops;
+    };
+
+    template< typename F, typename Fn >
+    void construct(Fn&& fn, std::true_type) {
+      new (buffer) F(std::forward< Fn >(fn));
+      ops = &InlineOps< F >::ops;
+    }
+
+    template< typename F, typename Fn >
+    void construct(Fn&& fn, std::false_type) {
+      *reinterpret_cast< F** >(buffer) = new F(std::forward< Fn >(fn));
+      ops = &HeapOps< F >::ops;
+    }
+
+    void moveFrom(InlineCallback& other) {
+      ops = other.ops;
+      if (ops) {
+        ops->move(buffer, other.buffer);
+        other.ops = nullptr;
+      }
+    }
+
+    const Ops* ops = nullptr;
+    alignas(std::max_align_t) unsigned char buffer[inline_size];
+  };
+
+  template< typename F >
+  const InlineCallback::Ops InlineCallback::InlineOps< F >::ops = { &invoke, &move, &destroy };
+  template< typename F >
+  const InlineCallback::Ops InlineCallback::HeapOps< F >::ops = { &invoke, &move, &destroy };
+
+  class RequestCallback;
+
+  // A request body already serialized. The request keeps a reference until it completes,
+  // so the same body can be sent many times without serializing, compressing or copying it again.
+  struct PreparedBody {
+    std::string text;
+    std::string gzip;       // Empty unless the db gzips the request bodies of this size
+  };
+  using SharedBody = std::shared_ptr< const PreparedBody >;
+
+  // Direct conversion of the MINI_FIRESTORE_DEFINE types, defined at the end of the file
+  namespace Schema {
+    template< typename T > struct IsDefined;
+    template< typename T > void encodeFields(std::string& out, const T& obj);
+    template< typename T > void decodeFields(const json& fields, T& obj);
+  }
+
   static const int ERR_DOC_MISSING = 1;
+  static const int ERR_TRANSACTION_ABORTED = 2;
   static const int ERR_AUTH_EMAIL_NOT_FOUND = 400;
 
   struct Condition {
@@ -50,18 +184,93 @@ namespace MiniFireStore
     std::vector< OrderBy > order_by;
   };
 
+  // Changes to the fields of a doc sent in a single write by Ref::update. Field paths use dots
+  // for the nested fields, like "stats.hp". The other fields of the doc are not modified
+  struct UpdateSpec {
+
+    UpdateSpec& set(const std::string& field_path, const json& value);
+    UpdateSpec& remove(const std::string& field_path);
+    UpdateSpec& increment(const std::string& field_path, const json& value);
+    UpdateSpec& maximum(const std::string& field_path, const json& value);
+    UpdateSpec& minimum(const std::string& field_path, const json& value);
+    UpdateSpec& serverTimestamp(const std::string& field_path);
+    UpdateSpec& arrayUnion(const std::string& field_path, const json& values);    // Appends the missing values
+    UpdateSpec& arrayRemove(const std::string& field_path, const json& values);   // Removes all the instances
+
+    bool must_exist = false;                  // Fail with NOT_FOUND instead of creating the doc
+
+    struct Transform {
+      std::string field_path;
+      const char* op;                         // As named in the api: increment, maximum, setToServerValue...
+      json        value;
+    };
+    json                       fields = json::value_t::object;     // Nested as the doc
+    std::vector< std::string > field_paths;                       // Set or removed
+    std::vector< Transform >   transforms;
+  };
+
   class Ref {
   public:
 
-    uint32_t read(Callback cb) const;
-    uint32_t write(const json& j, Callback cb) const;
-    uint32_t del(Callback cb) const;
-    uint32_t add(const json& j, Callback cb) const;
-    uint32_t query(const Query& q, Callback cb) const;
-    uint32_t inc(const std::string& field_name, double value, Callback cb) const;
-    uint32_t list(Callback cb, int page_size = 0, const char* next_token = nullptr) const;
-    uint32_t listAll(Callback cb) const;
-    uint32_t patch(const std::string& field_name, const json& new_value, Callback cb) const;
+    uint32_t read(RequestCallback cb) const;
+    uint32_t write(const json& j, RequestCallback cb) const;
+    uint32_t del(RequestCallback cb) const;
+    uint32_t add(const json& j, RequestCallback cb) const;
+    uint32_t query(const Query& q, RequestCallback cb) const;
+    uint32_t inc(const std::string& field_name, double value, RequestCallback cb) const;
+    uint32_t list(RequestCallback cb, int page_size = 0, const char* next_token = nullptr) const;
+    uint32_t listAll(RequestCallback cb) const;
+    uint32_t patch(const std::string& field_name, const json& new_value, RequestCallback cb) const;
+    // The result j has the value of each transformed field after the write, by field path
+    uint32_t update(const UpdateSpec& spec, RequestCallback cb) const;
+
+    // Writes guarded by a precondition, checked by the server in the same request.
+    // writeIf fails with FAILED_PRECONDITION if the doc was modified after update_time (from Result::update_time),
+    // create with ALREADY_EXISTS if the doc exists, and updateIfExists with NOT_FOUND if it doesn't
+    uint32_t writeIf(const json& j, const std::string& update_time, RequestCallback cb) const;
+    uint32_t create(const json& j, RequestCallback cb) const;
+    uint32_t updateIfExists(const json& j, RequestCallback cb) const;
+
+    // Serialize once the body of write(j) and send it as many times as required with commit
+    SharedBody prepareWrite(const json& j) const;
+    uint32_t commit(const SharedBody& body, RequestCallback cb) const;
+
+    // The MINI_FIRESTORE_DEFINE types are encoded directly in the body, without an intermediate json
+    template< typename T, typename std::enable_if< Schema::IsDefined< T >::value, int >::type = 0 >
+    uint32_t write(const T& obj, RequestCallback cb) const;
+
+    template< typename T, typename std::enable_if< Schema::IsDefined< T >::value, int >::type = 0 >
+    SharedBody prepareWrite(const T& obj) const {
+      std::string body;
+      beginWriteBody(body);
+      Schema::encodeFields(body, obj);
+      body += "}}}";
+      return makeBody(std::move(body));
+    }
+
+    // Like read, but the doc is kept in r.fields with the typed values of the api, and r.j is left empty.
+    // Result::get of the MINI_FIRESTORE_DEFINE types decodes r.fields without building the plain json
+    uint32_t readFields(RequestCallback cb) const;
+
+    // Same methods returning a Future instead of taking a callback
+    Future read() const;
+    Future readFields() const;
+    Future write(const json& j) const;
+    Future del() const;
+    Future add(const json& j) const;
+    Future query(const Query& q) const;
+    Future inc(const std::string& field_name, double value) const;
+    Future list(int page_size = 0, const char* next_token = nullptr) const;
+    Future listAll() const;
+    Future patch(const std::string& field_name, const json& new_value) const;
+    Future update(const UpdateSpec& spec) const;
+    Future writeIf(const json& j, const std::string& update_time) const;
+    Future create(const json& j) const;
+    Future updateIfExists(const json& j) const;
+    Future commit(const SharedBody& body) const;
+
+    template< typename T, typename std::enable_if< Schema::IsDefined< T >::value, int >::type = 0 >
+    Future write(const T& obj) const;
 
     Ref() = default;
 
@@ -80,6 +289,14 @@ namespace MiniFireStore
     std::string doc_id;
 
     bool sendRPC(const char* url_suffix, const json& body, Result& result, const char* label, int flags = 0) const;
+    json writeCommand(const json& j, const json& precondition = json()) const;
+    json updateWrite(const json& j) const;
+    uint32_t readDoc(RequestCallback cb, const std::string* transaction_id, bool keep_fields = false) const;
+    void beginWriteBody(std::string& body) const;
+    uint32_t sendWrite(const SharedBody& body, RequestCallback cb, const char* label) const;
+    SharedBody makeBody(std::string&& text) const;
+
+    friend class Transaction;
   };
 
   struct Result {
@@ -88,17 +305,400 @@ namespace MiniFireStore
     std::string str;
     json        j;
     std::string added_id;
+    std::string update_time;                  // Of the doc read or written
+    std::vector< std::string > update_times;  // Of each doc in the results of a query, parallel to j
+
+    // Details of the errors. http_status is 0 when the request didn't reach the server, see curl_code then.
+    // The body of the errors is only parsed to json in the connect requests, the text is in str
+    long        http_status = 0;
+    int         curl_code = 0;                // CURLcode of the transfer
+    std::string grpc_status;                  // OK, NOT_FOUND, ABORTED, RESOURCE_EXHAUSTED, UNAVAILABLE, ...
+    int         retry_after_secs = -1;        // Retry-After header of the answer, -1 when not present
+
+    // Body sizes. wire is what travels over the network, the others are the decoded json
+    size_t      bytes_sent = 0;
+    size_t      bytes_sent_wire = 0;
+    size_t      bytes_recv = 0;
+    size_t      bytes_recv_wire = 0;
+
+    json        fields;                       // Typed values of the doc, only filled by Ref::readFields
 
     template< typename T >
     bool get(T& obj) const {
       if (err)
         return false;
-      obj = j.get<T>();
+      getValue(obj, Schema::IsDefined< T >());
       return true;
     }
 
     static const std::string& getDocKeyName();
 
+  private:
+    template< typename T >
+    void getValue(T& obj, std::true_type) const {
+      if (!fields.is_object()) {
+        obj = j.get<T>();
+        return;
+      }
+      obj = T();
+      Schema::decodeFields(fields, obj);
+    }
+
+    template< typename T >
+    void getValue(T& obj, std::false_type) const {
+      obj = j.get<T>();
+    }
+
+  };
+
+  // Result of a request that will be available in a later Firestore::update. Copies refer to the same result.
+  // then() runs a continuation once the result is available, returning a new future:
+  //
+  //    ref.read().then([=](Result& r) {
+  //      return ref2.write(summaryOf(r.j));        // Returning a Future chains the request
+  //    }).then([](Result& r) {                     // or return void to pass the same result
+  //      ...
+  //    });
+  //
+  // Each future can be continued once, and the continuation receives the result by reference, so it can
+  // move out of it. Continuations of futures already resolved run inside then().
+  class Future {
+  public:
+
+    struct State : public std::enable_shared_from_this< State > {
+      bool                     ready = false;
+      bool                     continued = false;
+      Result                   result;
+      std::shared_ptr< State > next;              // Receives the result when ready
+      int                      next_index = 0;    // Position of this future in when_all
+
+      virtual ~State() = default;
+      // Called with the result of the previous future. By default, it's the result of this future
+      virtual void receive(Result& r, int index);
+      void resolve(Result& r);
+      void chain(const std::shared_ptr< State >& new_next, int index);
+    };
+
+    Future() = default;
+    explicit Future(const std::shared_ptr< State >& new_state) : state(new_state) {}
+
+    // Already resolved with the given result
+    static Future resolved(const Result& r);
+
+    bool isValid() const { return state != nullptr; }
+    bool isReady() const { return state && state->ready; }
+    const Result& result() const { return state->result; }    // Only when ready and not continued
+
+    // fn(Result&) can return void, or a Future or anything convertible to it, like a Task
+    template< typename Fn >
+    Future then(Fn fn) const;
+
+  private:
+    template< typename Fn >
+    struct ThenState : public State {
+      Fn   fn;
+      bool called = false;                        // Then, the result comes from the future returned by fn
+      explicit ThenState(Fn new_fn) : fn(std::move(new_fn)) {}
+      void receive(Result& r, int) override {
+        if (called) {
+          resolve(r);
+          return;
+        }
+        called = true;
+        call(r, std::is_convertible< decltype(fn(r)), Future >());
+      }
+      void call(Result& r, std::false_type) {
+        fn(r);
+        resolve(r);
+      }
+      void call(Result& r, std::true_type) {
+        Future inner = fn(r);
+        assert(inner.isValid());
+        inner.state->chain(shared_from_this(), 0);
+      }
+    };
+
+    std::shared_ptr< State > state;
+
+    friend Future when_all(const std::vector< Future >& futures);
+    friend Future when_any(const std::vector< Future >& futures);
+  };
+
+  // Resolves once all the futures are resolved. r.j is the array with the j of each result, and r.err the
+  // first error found, or 0. The futures can not be continued again
+  Future when_all(const std::vector< Future >& futures);
+  // Resolves with the result of the first future resolved. The futures can not be continued again
+  Future when_any(const std::vector< Future >& futures);
+
+  // Resolves its future when the callback is called, to adapt the methods with callbacks to futures
+  class Promise {
+  public:
+    Promise() : state(std::make_shared< Future::State >()) {}
+    Future future() const { return Future(state); }
+    Callback callback() const;
+    void resolve(Result& r) const { state->resolve(r); }
+  private:
+    std::shared_ptr< Future::State > state;
+    friend class RequestCallback;
+  };
+
+  // Callback of the Ref methods. Holds the user callable, or the state of the Future returned by the
+  // methods without a callback, which is resolved directly instead of through a std::function
+  class RequestCallback {
+  public:
+    RequestCallback() = default;
+    RequestCallback(std::nullptr_t) {}
+    template< typename Fn, typename = typename std::enable_if< !std::is_same< typename std::decay< Fn >::type, RequestCallback >::value
+      && std::is_constructible< Callback, Fn&& >::value >::type >
+    RequestCallback(Fn&& fn) : callback(std::forward< Fn >(fn)) {}
+    explicit RequestCallback(const Promise& promise);
+
+    void operator()(Result& r) const;
+
+  private:
+    Callback                         callback;
+    std::shared_ptr< Future::State > future_state;
+  };
+
+  template< typename Fn >
+  Future Future::then(Fn fn) const {
+    assert(state);
+    std::shared_ptr< State > then_state = std::make_shared< ThenState< Fn > >(std::move(fn));
+    state->chain(then_state, 0);
+    return Future(then_state);
+  }
+
+  template< typename T, typename std::enable_if< Schema::IsDefined< T >::value, int >::type >
+  uint32_t Ref::write(const T& obj, RequestCallback cb) const {
+    return sendWrite(prepareWrite(obj), std::move(cb), "write");
+  }
+
+  template< typename T, typename std::enable_if< Schema::IsDefined< T >::value, int >::type >
+  Future Ref::write(const T& obj) const {
+    Promise p;
+    write(obj, RequestCallback(p));
+    return p.future();
+  }
+
+#if MINI_FIRESTORE_COROUTINES
+  // co_await of a Future suspends the coroutine until the result arrives, and resumes it inside Firestore::update
+  struct FutureAwaiter {
+    Future future;
+    Result result;
+    bool   received = false;
+
+    bool await_ready() const { return future.isReady(); }
+    void await_suspend(std::coroutine_handle<> handle) {
+      future.then([this, handle](Result& r) {
+        result = std::move(r);
+        received = true;
+        handle.resume();
+      });
+    }
+    Result await_resume() { return received ? std::move(result) : future.result(); }
+  };
+
+  inline FutureAwaiter operator co_await(Future future) {
+    return FutureAwaiter{ std::move(future) };
+  }
+
+  // Coroutine returning a Result. It starts running when called, and can be awaited or used as a Future:
+  //
+  //    Task countDocs(Ref coll) {
+  //      Result r = co_await coll.listAll();
+  //      r.j = r.j["documents"].size();
+  //      co_return r;
+  //    }
+  //
+  // The frame is released when the coroutine returns.
+  class Task {
+  public:
+    struct promise_type {
+      Promise promise;
+      Task get_return_object() { return Task(promise.future()); }
+      std::suspend_never initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_value(Result r) { promise.resolve(r); }
+      void unhandled_exception() { std::terminate(); }
+    };
+
+    Future future() const { return result; }
+    operator Future() const { return result; }
+
+  private:
+    explicit Task(Future new_result) : result(std::move(new_result)) {}
+    Future result;
+  };
+
+  inline FutureAwaiter operator co_await(const Task& task) {
+    return FutureAwaiter{ task.future() };
+  }
+#endif
+
+  // Reads and writes of a transaction, see Firestore::runTransaction. Copies refer to the
+  // same transaction, so it can be captured by value in the callbacks of the reads
+  class Transaction {
+  public:
+
+    // Reads the doc inside the transaction. The result is the same as Ref::read
+    uint32_t read(const Ref& ref, Callback cb) const;
+
+    // The writes are kept in the client, and sent together by commit
+    void write(const Ref& ref, const json& j) const;
+    void del(const Ref& ref) const;
+
+    // Ends the transaction. One of them must be called once, after the reads have completed
+    void commit() const;
+    void abort() const;
+
+    int attempt() const;                  // 1 the first time the body runs
+
+  private:
+    struct State;
+    std::shared_ptr< State > state;
+
+    friend class Firestore;
+  };
+  using TransactionBody = std::function<void(Transaction tr)>;
+
+  // Snapshot of the metrics collected by the Firestore. See Firestore::stats
+  struct Stats {
+
+    // Log-linear histogram of durations in microseconds: 8 buckets for each power of two,
+    // so the values reported have an error below 12.5%. Covers up to 2^32 us (~71 minutes)
+    struct Histogram {
+      static const int num_buckets = 248;
+      uint64_t counts[num_buckets] = {};
+      uint64_t count = 0;
+      uint64_t sum_us = 0;
+      uint64_t max_us = 0;
+
+      uint64_t percentile(double p) const;    // p in the range [0..1]
+      double   mean() const { return count ? (double)sum_us / (double)count : 0.0; }
+
+      static int      bucketOf(uint64_t us);
+      static uint64_t bucketUpperBound(int bucket);
+    };
+
+    // Per label of request: read, write, query, inc, ...
+    struct Op {
+      std::string label;
+      uint64_t    requests = 0;               // Completed, including the errors
+      uint64_t    errors = 0;
+      uint64_t    replays = 0;                // Sent again after an UNAUTHENTICATED answer
+      uint64_t    new_connections = 0;
+      uint64_t    bytes_sent = 0;
+      uint64_t    bytes_sent_wire = 0;
+      uint64_t    bytes_recv = 0;
+      uint64_t    bytes_recv_wire = 0;
+
+      Histogram   queue;                      // Waiting to be sent or to be collected by update()
+      Histogram   dns;                        // dns, connect and tls only when a new connection was opened
+      Histogram   connect;
+      Histogram   tls;
+      Histogram   ttfb;                       // Request sent -> first byte of the answer
+      Histogram   transfer;                   // First byte -> last byte of the answer
+      Histogram   total;
+    };
+
+    std::vector< Op > ops;
+    uint32_t    in_flight = 0;
+    uint32_t    held = 0;                     // Waiting for a token refresh
+    uint32_t    deferred = 0;                 // Waiting for the rate limiter
+    uint32_t    free_requests = 0;            // Pooled
+
+    // Requests/sec currently allowed by the adaptive rate limiter. 0 when it's disabled
+    double      read_rate = 0.0;
+    double      write_rate = 0.0;
+  };
+
+  // Adaptive client side rate limiter. Reads and writes have independent token buckets. Their rate
+  // grows while the answers are fine, and is cut when the server answers RESOURCE_EXHAUSTED or
+  // UNAVAILABLE, or the answers are slower than slow_answer_ms. A Retry-After answer pauses the class.
+  // Requests over the rate wait in the client until update() can send them.
+  struct RateLimits {
+    bool   enabled = false;
+    double initial_rate = 500.0;              // Requests/sec of each class. Firestore suggests starting at 500 writes/sec
+    double min_rate = 1.0;
+    double max_rate = 10000.0;
+    double increase = 50.0;                   // Requests/sec added for each second of answers without errors
+    double decrease_factor = 0.5;             // Applied at most once every 250ms
+    int    slow_answer_ms = 0;                // 0 to ignore the latency
+  };
+  void to_json(json& j, const Stats& stats);
+
+  // Receives the begin and end of each request. See Firestore::setTracer
+  class Tracer {
+  public:
+
+    struct Span {
+      uint32_t    req_unique_id = 0;
+      const char* label = nullptr;
+      std::string path;                       // Url without the host and the query
+      size_t      body_size = 0;
+      int         retries = 0;                // Sent again after an UNAUTHENTICATED answer
+      std::chrono::steady_clock::time_point begin_time;
+
+      // Only valid in end()
+      std::chrono::steady_clock::time_point end_time;
+      int         err = 0;
+      long        http_status = 0;
+      size_t      recv_size = 0;
+      bool        new_connection = false;
+
+      // Consecutive phases, in us. They add up to end_time - begin_time
+      uint64_t    queue_us = 0;               // Held, or waiting to be sent or collected by update()
+      uint64_t    dns_us = 0;
+      uint64_t    connect_us = 0;
+      uint64_t    tls_us = 0;
+      uint64_t    send_us = 0;
+      uint64_t    ttfb_us = 0;                // Request sent -> first byte of the answer
+      uint64_t    transfer_us = 0;
+    };
+
+    virtual ~Tracer() = default;
+    virtual void begin(const Span& span) = 0;
+    virtual void end(const Span& span) = 0;
+  };
+
+  // Keeps all the spans and saves them in the Chrome trace event format, to be
+  // opened with chrome://tracing or https://ui.perfetto.dev
+  class ChromeTraceExporter : public Tracer {
+  public:
+    void begin(const Span&) override { }
+    void end(const Span& span) override;
+
+    json toJson() const;
+    bool save(const std::string& filename) const;
+    void clear() { spans.clear(); }
+
+  private:
+    std::vector< Span > spans;
+  };
+
+  // The connections and the I/O loop shared by many Firestore sessions, like one session per
+  // authenticated user. Each session keeps its own token, headers, limits and stats, while the
+  // requests of all of them go through the same curl multi handle and connection cache.
+  // Attach the sessions with Firestore::setTransport before configure. The transport must outlive
+  // them, or they are disconnected when it's destroyed.
+  class Transport {
+  public:
+    Transport();
+    Transport(const Transport&) = delete;
+    ~Transport();
+
+    // Sends and receives for all the sessions, running their callbacks. Returns true if some work was done
+    bool update();
+    // Blocks until there is network activity in any session or timeout_ms elapses
+    void wait(int timeout_ms);
+    bool hasFinished() const;
+    size_t numSessions() const;
+
+    struct Impl;
+
+  private:
+    Impl* impl = nullptr;
+    friend class Firestore;
   };
 
   class Firestore {
@@ -113,23 +713,71 @@ namespace MiniFireStore
 
     void configure(const char* project_id, const char* api_key);
 
+    // Send all the requests to a local emulator (host:port) instead of the google services
+    void useEmulator(const std::string& host);
+
     void signUp(const std::string& email, const std::string& password, Callback cb);
     void connect(const std::string& email, const std::string& password, Callback cb);
     void connectOrSignUp(const std::string& email, const std::string& password, Callback cb);
     void disconnect();
 
+    // Request compressed answers (gzip/br), and gzip the bodies larger than gzip_requests_min_size bytes (0 to disable)
+    void setCompression(bool compress_responses, size_t gzip_requests_min_size = 0);
+
+    // Opens num_connections to the firestore and the auth services in the background, so the
+    // first requests after the login don't wait for the DNS, TCP and TLS setup. Call it after
+    // configure, and before connect to overlap it with the login. Idle connections are closed
+    // by curl after ~2 minutes. With HTTP/2 the requests to a host are multiplexed, so only one
+    // connection per host is opened whatever num_connections is
+    void prewarm(int num_connections = 1);
+
+    // Shares the connections and the I/O loop with the other sessions of the transport. Call it
+    // before configure. Use nullptr to go back to a private transport after disconnect
+    void setTransport(Transport* new_transport);
+
+    // With a shared transport, update and wait run the requests of all its sessions
     bool update();
+    // Blocks until there is network activity or timeout_ms elapses, to avoid spinning on update
+    void wait(int timeout_ms);
+    // Only the requests of this session
     bool hasFinished() const;
     void dump() const;
 
+    // Counters, gauges and latency histograms of the requests since configure or the last resetStats.
+    // Recording them uses only relaxed atomics, and stats() can be called from any thread
+    Stats stats() const;
+    void resetStats();
+
+    void setRateLimits(const RateLimits& new_rate_limits);
+    // Caps the writes to the docs of a collection, i.e. "users/123/messages". The recommended
+    // sustained rate is 1 write/sec per document. Use 0 to remove the cap
+    void setCollectionWriteRate(const std::string& collection_path, double writes_per_sec);
+
+    // The tracer is not owned, and must be alive until it's replaced or the Firestore is destroyed
+    void setTracer(Tracer* new_tracer) { tracer = new_tracer; }
+
+    // Runs body inside a transaction: the docs read with tr.read are guaranteed not to change until
+    // tr.commit sends all the writes. If they changed (ABORTED), the body runs again after a backoff,
+    // up to max_attempts times. cb receives the result of the commit, or err = ERR_TRANSACTION_ABORTED
+    // if the body calls tr.abort
+    void runTransaction(TransactionBody body, Callback cb, int max_attempts = 5);
+
     const std::string& uid() const { return user_id; }
     Ref ref(const std::string& path);
 
     friend class Ref;
+    friend class Transaction;
+    friend class Transport;
 
   private:
 
-    void setToken(const std::string& new_token);
+    void setupUrls();
+    std::string serviceUrl(const char* url) const;
+    void setToken(const std::string& new_token, const std::string& new_refresh_token, int expires_in_secs);
+    void checkTokenExpiration();
+    void refreshToken();
+    void beginTransaction(std::shared_ptr< Transaction::State > state, const std::string& retry_id);
+    void schedule(int delay_ms, std::function<void()> fn);
     void authRequest(const char* url_base, const std::string& email, const std::string& password, Callback cb);
 
     std::string user_id;
@@ -137,12 +785,23 @@ namespace MiniFireStore
     std::string project_id;
     std::string url_root;
     std::string doc_root;
+    std::string emulator_host;
     std::string token;
+    std::string refresh_token;
+    std::chrono::steady_clock::time_point token_refresh_time;   // Some margin before the token expires
+
+    Tracer*     tracer = nullptr;
+    Transport*  transport = nullptr;
+    RateLimits  rate_limits;
+    std::unordered_map< std::string, double > collection_write_rates;
+    bool        compress_responses = false;
+    size_t      gzip_requests_min_size = 0;
 
     struct OTFRequests;
     OTFRequests* otf = nullptr;
 
-    uint32_t allocRequest(const std::string& url_suffix, const json& jbody, Callback cb, const char* label, int flags = 0);
+    // doc_path is the doc or collection modified by the writes, for the collection caps
+    uint32_t allocRequest(const std::string& url_suffix, const json& jbody, InlineCallback cb, const char* label, int flags = 0, const SharedBody& prepared_body = SharedBody(), const std::string& doc_path = std::string());
   };
 
   // -------------------------------------------------------
@@ -158,8 +817,279 @@ namespace MiniFireStore
   void setLogLevel(eLevel new_level);
 
   // -------------------------------------------------------
+  // RFC3339 date times, like 2022-04-15T14:25:30.123456789Z or 2022-04-15T16:25:30+02:00.
+  // The conversions don't depend on the locale or the timezone of the machine
+  struct Timestamp {
+    int64_t secs = 0;                       // Since 1970-01-01T00:00:00Z
+    int32_t nanos = 0;                      // [0..999999999]
+
+    Timestamp() = default;
+    explicit Timestamp(time_t utc_time) : secs((int64_t)utc_time) {}
+    Timestamp(int64_t new_secs, int32_t new_nanos) : secs(new_secs), nanos(new_nanos) {}
+
+    bool operator==(const Timestamp& other) const { return secs == other.secs && nanos == other.nanos; }
+    bool operator!=(const Timestamp& other) const { return !(*this == other); }
+    bool operator<(const Timestamp& other) const { return secs < other.secs || (secs == other.secs && nanos < other.nanos); }
+  };
+
+  bool parseTimestamp(const char* str, size_t len, Timestamp* out);
+  bool parseTimestamp(const std::string& str, Timestamp* out);
+  std::string formatTimestamp(const Timestamp& ts);   // Always in UTC, with 0, 3, 6 or 9 decimals
+
+  // Stored in json as the RFC3339 string, which asValue sends as a timestampValue
+  void to_json(json& j, const Timestamp& ts);
+  void from_json(const json& j, Timestamp& ts);
+
   json timeToISO8601(time_t utc_time);
   bool ISO8601ToTime(const json& j, time_t* out_time_t);
   bool isTimeISO8601(const std::string& str);
 
+  // -------------------------------------------------------
+  // Standard base64, used by the bytesValue fields. Decoding also accepts the url safe alphabet and missing padding
+  std::string base64Encode(const uint8_t* data, size_t size);
+  bool base64Decode(const char* str, size_t len, std::vector< uint8_t >& out);
+  bool base64Decode(const std::string& str, std::vector< uint8_t >& out);
+
+  // -------------------------------------------------------
+  // Conversion between plain json and the typed values of the REST api
+  // Binary json values (json::binary) travel as bytesValue
+  json asValue(const json& inValue);        // "abc" -> { "stringValue" : "abc" }
+  json asDocument(const json& inDoc);       // { "a" : 1, "b" : 0.5 } -> { "fields" : { "a" : { "integerValue" : "1" }, "b" : { "doubleValue" : 0.5 } } }
+  json fromValue(const json& j);
+  json fromFields(const json& j);
+
+  // -------------------------------------------------------
+  bool gzipCompress(const std::string& input, std::string& output);
+
+  // -------------------------------------------------------
+  // Schemas of user structs. MINI_FIRESTORE_DEFINE(Person, age, name), next to the struct, generates its
+  // to_json/from_json and a direct conversion to/from the typed values of the api, used by Ref::write(person),
+  // Ref::prepareWrite(person) and Result::get(person) after Ref::readFields. Members are encoded by type: bool,
+  // integers, floating point, std::string, Timestamp, json::binary_t, json, std::vector of those and other
+  // MINI_FIRESTORE_DEFINE types. Any other type goes through its to_json/from_json.
+  // Fields missing in the doc keep the default value of the struct.
+  namespace Schema {
+
+    // Fallback of the detection. The macro adds an overload for each type, found by ADL
+    std::false_type miniFirestoreIsDefined(...);
+
+    template< typename T >
+    struct IsDefined : decltype(miniFirestoreIsDefined((const T*)nullptr)) {};
+
+    // Writers of the typed values as json text
+    void writeQuoted(std::string& out, const char* str, size_t len);
+    void writeBool(std::string& out, bool value);
+    void writeInteger(std::string& out, int64_t value);
+    void writeUnsigned(std::string& out, uint64_t value);        // As double above INT64_MAX, like asValue
+    void writeDouble(std::string& out, double value);
+    void writeString(std::string& out, const std::string& value);  // timestampValue if it looks like one, like asValue
+    void writeTimestamp(std::string& out, const Timestamp& value);
+    void writeBytes(std::string& out, const json::binary_t& value);
+    void writeJson(std::string& out, const json& value);
+
+    // Readers of the typed values. Keep the output when the value has a different type
+    bool readBool(const json& v, bool& out);
+    bool readInteger(const json& v, int64_t& out);
+    bool readUnsigned(const json& v, uint64_t& out);
+    bool readDouble(const json& v, double& out);
+    bool readString(const json& v, std::string& out);
+    bool readTimestamp(const json& v, Timestamp& out);
+    bool readBytes(const json& v, json::binary_t& out);
+    const json* mapFields(const json& v);                       // The fields of a mapValue
+    const json* arrayValues(const json& v);                     // The values of an arrayValue
+
+    // Types without a schema go through json
+    template< typename T, typename Enable = void >
+    struct Codec {
+      static void write(std::string& out, const T& value) { writeJson(out, json(value)); }
+      static void read(const json& v, T& value) { fromValue(v).get_to(value); }
+    };
+
+    template<>
+    struct Codec< bool > {
+      static void write(std::string& out, bool value) { writeBool(out, value); }
+      static void read(const json& v, bool& value) { readBool(v, value); }
+    };
+
+    template< typename T >
+    struct Codec< T, typename std::enable_if< std::is_integral< T >::value && !std::is_same< T, bool >::value >::type > {
+      static void write(std::string& out, T value) {
+        if (std::is_signed< T >::value)
+          writeInteger(out, (int64_t)value);
+        else
+          writeUnsigned(out, (uint64_t)value);
+      }
+      static void read(const json& v, T& value) {
+        if (std::is_signed< T >::value) {
+          int64_t i;
+          if (readInteger(v, i))
+            value = (T)i;
+        }
+        else {
+          uint64_t u;
+          if (readUnsigned(v, u))
+            value = (T)u;
+        }
+      }
+    };
+
+    template< typename T >
+    struct Codec< T, typename std::enable_if< std::is_floating_point< T >::value >::type > {
+      static void write(std::string& out, T value) { writeDouble(out, (double)value); }
+      static void read(const json& v, T& value) {
+        double d;
+        if (readDouble(v, d))
+          value = (T)d;
+      }
+    };
+
+    template<>
+    struct Codec< std::string > {
+      static void write(std::string& out, const std::string& value) { writeString(out, value); }
+      static void read(const json& v, std::string& value) { readString(v, value); }
+    };
+
+    template<>
+    struct Codec< Timestamp > {
+      static void write(std::string& out, const Timestamp& value) { writeTimestamp(out, value); }
+      static void read(const json& v, Timestamp& value) { readTimestamp(v, value); }
+    };
+
+    template<>
+    struct Codec< json::binary_t > {
+      static void write(std::string& out, const json::binary_t& value) { writeBytes(out, value); }
+      static void read(const json& v, json::binary_t& value) { readBytes(v, value); }
+    };
+
+    template<>
+    struct Codec< json > {
+      static void write(std::string& out, const json& value) { writeJson(out, value); }
+      static void read(const json& v, json& value) { value = fromValue(v); }
+    };
+
+    template< typename T, typename A >
+    struct Codec< std::vector< T, A > > {
+      static void write(std::string& out, const std::vector< T, A >& values) {
+        out += "{\"arrayValue\":{\"values\":[";
+        for (size_t i = 0; i < values.size(); ++i) {
+          if (i)
+            out += ',';
+          Codec< T >::write(out, values[i]);
+        }
+        out += "]}}";
+      }
+      static void read(const json& v, std::vector< T, A >& values) {
+        values.clear();
+        const json* items = arrayValues(v);
+        if (!items)
+          return;
+        values.reserve(items->size());
+        for (const json& item : *items) {
+          T value = T();
+          Codec< T >::read(item, value);
+          values.push_back(std::move(value));
+        }
+      }
+    };
+
+    template< typename T >
+    struct Codec< T, typename std::enable_if< IsDefined< T >::value >::type > {
+      static void write(std::string& out, const T& value) {
+        out += "{\"mapValue\":{\"fields\":";
+        encodeFields(out, value);
+        out += "}}";
+      }
+      static void read(const json& v, T& value) {
+        value = T();
+        const json* fields = mapFields(v);
+        if (fields)
+          decodeFields(*fields, value);
+      }
+    };
+
+    // Visitors of the members of the structs. The names are string literals, so their size is known at compile time
+    struct FieldsWriter {
+      std::string& out;
+      bool         first;
+      template< size_t N, typename V >
+      void operator()(const char (&name)[N], const V& value) {
+        if (!first)
+          out += ',';
+        first = false;
+        out += '"';
+        out.append(name, N - 1);
+        out += "\":";
+        Codec< V >::write(out, value);
+      }
+    };
+
+    struct FieldsReader {
+      const json& fields;
+      template< size_t N, typename V >
+      void operator()(const char (&name)[N], V& value) const {
+        auto it = fields.find(name);
+        if (it != fields.end())
+          Codec< V >::read(*it, value);
+      }
+    };
+
+    struct PlainWriter {
+      json& j;
+      template< size_t N, typename V >
+      void operator()(const char (&name)[N], const V& value) const {
+        j[name] = value;
+      }
+    };
+
+    struct PlainReader {
+      const json& j;
+      template< size_t N, typename V >
+      void operator()(const char (&name)[N], V& value) const {
+        auto it = j.find(name);
+        if (it != j.end())
+          it->get_to(value);
+      }
+    };
+
+    // The fields as the json object {"age":{"integerValue":"32"},...}
+    template< typename T >
+    void encodeFields(std::string& out, const T& obj) {
+      FieldsWriter writer{ out, true };
+      out += '{';
+      miniFirestoreVisit(obj, writer);
+      out += '}';
+    }
+
+    template< typename T >
+    void decodeFields(const json& fields, T& obj) {
+      FieldsReader reader{ fields };
+      miniFirestoreVisit(obj, reader);
+    }
+
+    template< typename T >
+    void toPlain(json& j, const T& obj) {
+      j = json::value_t::object;
+      PlainWriter writer{ j };
+      miniFirestoreVisit(obj, writer);
+    }
+
+    template< typename T >
+    void fromPlain(const json& j, T& obj) {
+      PlainReader reader{ j };
+      miniFirestoreVisit(obj, reader);
+    }
+  }
+
 }
+
+#define MINI_FIRESTORE_VISIT_FIELD(field) mini_firestore_visitor(#field, mini_firestore_obj.field);
+
+// At the namespace of Type, with the members to store. Up to 63 members
+#define MINI_FIRESTORE_DEFINE(Type, ...)  \
+  template< typename Visitor > \
+  inline void miniFirestoreVisit(const Type& mini_firestore_obj, Visitor& mini_firestore_visitor) { NLOHMANN_JSON_EXPAND(NLOHMANN_JSON_PASTE(MINI_FIRESTORE_VISIT_FIELD, __VA_ARGS__)) } \
+  template< typename Visitor > \
+  inline void miniFirestoreVisit(Type& mini_firestore_obj, Visitor& mini_firestore_visitor) { NLOHMANN_JSON_EXPAND(NLOHMANN_JSON_PASTE(MINI_FIRESTORE_VISIT_FIELD, __VA_ARGS__)) } \
+  inline std::true_type miniFirestoreIsDefined(const Type*) { return std::true_type(); } \
+  inline void to_json(MiniFireStore::json& j, const Type& obj) { MiniFireStore::Schema::toPlain(j, obj); } \
+  inline void from_json(const MiniFireStore::json& j, Type& obj) { MiniFireStore::Schema::fromPlain(j, obj); }